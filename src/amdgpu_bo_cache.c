@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <xf86.h>
+#include "amdgpu_drv.h"
+#include "amdgpu_bo_helper.h"
+#include "amdgpu_bo_cache.h"
+
+static unsigned amdgpu_bo_cache_bucket(uint32_t size)
+{
+	unsigned bucket = 0;
+
+	while (size >>= 1)
+		bucket++;
+
+	return bucket;
+}
+
+static Bool amdgpu_bo_cache_match(const struct amdgpu_bo_cache_key *want,
+				  const struct amdgpu_bo_cache_key *have)
+{
+	if (want->format != have->format || want->usage != have->usage ||
+	    want->domain != have->domain ||
+	    want->alloc_flags != have->alloc_flags ||
+	    want->tiling_info != have->tiling_info)
+		return FALSE;
+
+	if (want->format)
+		return want->width == have->width &&
+			want->height == have->height;
+
+	return have->size >= want->size &&
+		have->size <= want->size + want->size / 4;
+}
+
+static void amdgpu_bo_cache_evict(struct amdgpu_bo_cache *cache,
+				  struct amdgpu_buffer *bo)
+{
+	xorg_list_del(&bo->cache_bucket);
+	xorg_list_del(&bo->cache_lru);
+	cache->size -= bo->size;
+	amdgpu_bo_destroy(bo);
+}
+
+void amdgpu_bo_cache_init(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_cache *cache = &info->bo_cache;
+	MessageType from = X_DEFAULT;
+	int size_mb;
+	int i;
+
+	for (i = 0; i < AMDGPU_BO_CACHE_BUCKETS; i++)
+		xorg_list_init(&cache->buckets[i]);
+	xorg_list_init(&cache->lru);
+	cache->size = 0;
+	cache->hits = cache->misses = 0;
+
+	if (xf86GetOptValInteger(info->Options, OPTION_BO_CACHE_SIZE,
+				 &size_mb) && size_mb >= 0) {
+		cache->max_size = (uint64_t)size_mb << 20;
+		from = X_CONFIG;
+	} else
+		cache->max_size = info->vram_visible_size / 16;
+
+	xf86DrvMsg(pScrn->scrnIndex, from, "BO cache size: %llu MiB\n",
+		   (unsigned long long)(cache->max_size >> 20));
+}
+
+void amdgpu_bo_cache_fini(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_cache *cache = &info->bo_cache;
+	struct amdgpu_buffer *bo, *tmp;
+
+	if (cache->max_size == 0)
+		return;
+
+	xorg_list_for_each_entry_safe(bo, tmp, &cache->lru, cache_lru)
+		amdgpu_bo_cache_evict(cache, bo);
+
+	xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
+		       "BO cache: %lu hits, %lu misses\n",
+		       cache->hits, cache->misses);
+
+	cache->max_size = 0;
+}
+
+struct amdgpu_buffer *amdgpu_bo_cache_get(ScrnInfoPtr pScrn,
+					  const struct amdgpu_bo_cache_key *key)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_cache *cache = &info->bo_cache;
+	struct amdgpu_buffer *bo;
+	unsigned bucket, i;
+
+	if (cache->max_size == 0)
+		return NULL;
+
+	/* A BO up to 25% larger than requested may sit in the next bucket */
+	bucket = amdgpu_bo_cache_bucket(key->size);
+	for (i = bucket; i <= bucket + 1 && i < AMDGPU_BO_CACHE_BUCKETS; i++) {
+		xorg_list_for_each_entry(bo, &cache->buckets[i], cache_bucket) {
+			if (!amdgpu_bo_cache_match(key, &bo->cache_key))
+				continue;
+
+			xorg_list_del(&bo->cache_bucket);
+			xorg_list_del(&bo->cache_lru);
+			cache->size -= bo->size;
+			cache->hits++;
+			bo->ref_count = 1;
+			return bo;
+		}
+	}
+
+	cache->misses++;
+	return NULL;
+}
+
+Bool amdgpu_bo_cache_put(struct amdgpu_buffer *bo)
+{
+	AMDGPUInfoPtr info;
+	struct amdgpu_bo_cache *cache;
+
+	/* Only BOs from amdgpu_alloc_pixmap_bo have a cache key. BOs whose
+	 * name or fd was handed out may still be in use by other processes.
+	 */
+	if (!bo->scrn || !bo->cache_key.size ||
+	    (bo->flags & AMDGPU_BO_FLAGS_SHARED) ||
+	    amdgpu_bo_placement_migrated(bo))
+		return FALSE;
+
+	info = AMDGPUPTR(bo->scrn);
+	cache = &info->bo_cache;
+	if (bo->size > cache->max_size ||
+	    !amdgpu_bo_placement_policy(info, bo->usage)->cache)
+		return FALSE;
+
+	/* Nobody holds on to the CPU mapping anymore, but keep it around for
+	 * the next user of the BO as long as the mapping budget allows
+	 */
+	if (bo->map_count) {
+		bo->map_count = 1;
+		amdgpu_bo_map_release(bo);
+	}
+
+	bo->cache_time = GetTimeInMillis();
+	xorg_list_add(&bo->cache_bucket,
+		      &cache->buckets[amdgpu_bo_cache_bucket(bo->cache_key.size)]);
+	xorg_list_add(&bo->cache_lru, &cache->lru);
+	cache->size += bo->size;
+
+	while (cache->size > cache->max_size) {
+		struct amdgpu_buffer *lru = xorg_list_entry(cache->lru.prev,
+							    struct amdgpu_buffer,
+							    cache_lru);
+		amdgpu_bo_cache_evict(cache, lru);
+	}
+
+	return TRUE;
+}
+
+void amdgpu_bo_cache_expire(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_cache *cache = &info->bo_cache;
+	CARD32 now = GetTimeInMillis();
+
+	if (cache->max_size == 0)
+		return;
+
+	while (!xorg_list_is_empty(&cache->lru)) {
+		struct amdgpu_buffer *bo = xorg_list_entry(cache->lru.prev,
+							   struct amdgpu_buffer,
+							   cache_lru);
+
+		if ((CARD32)(now - bo->cache_time) < AMDGPU_BO_CACHE_TIMEOUT)
+			break;
+
+		amdgpu_bo_cache_evict(cache, bo);
+	}
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef AMDGPU_BO_CACHE_H
+#define AMDGPU_BO_CACHE_H 1
+
+#include <stdint.h>
+#include "list.h"
+#include "xf86str.h"
+
+/* Released BOs which aren't reused within this time are freed */
+#define AMDGPU_BO_CACHE_TIMEOUT		1000	/* ms */
+
+/* One bucket per power of two of the BO size */
+#define AMDGPU_BO_CACHE_BUCKETS		32
+
+struct amdgpu_buffer;
+
+/* Properties a cached BO must match to be handed out again. GBM BOs
+ * (format != 0) have to match exactly, other BOs may be up to 25% larger
+ * than requested. usage holds the GBM use flags of GBM BOs. tiling_info is
+ * the tiling mode of BOs we allocated ourselves, tiled and linear BOs
+ * mustn't be handed out for each other.
+ */
+struct amdgpu_bo_cache_key {
+	uint32_t size;
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t usage;
+	uint32_t domain;
+	uint64_t alloc_flags;	/* AMDGPU_GEM_CREATE_* */
+	uint64_t tiling_info;
+};
+
+struct amdgpu_bo_cache {
+	struct xorg_list buckets[AMDGPU_BO_CACHE_BUCKETS];
+	struct xorg_list lru;		/* most recently released first */
+	uint64_t size;			/* bytes currently held */
+	uint64_t max_size;		/* 0 disables the cache */
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* Set up the per-screen cache of released BOs, sized from the VRAM heap
+ * unless overridden with Option "BOCacheSize"
+ */
+extern void amdgpu_bo_cache_init(ScrnInfoPtr pScrn);
+
+/* Free all cached BOs and disable the cache */
+extern void amdgpu_bo_cache_fini(ScrnInfoPtr pScrn);
+
+/* Take a BO matching key out of the cache
+ *
+ * \return	BO with a single reference on a hit
+ *		NULL on a miss
+ */
+extern struct amdgpu_buffer *amdgpu_bo_cache_get(ScrnInfoPtr pScrn,
+						   const struct amdgpu_bo_cache_key *key);
+
+/* Park a BO whose last reference was dropped
+ *
+ * \return	TRUE if the cache took over the BO
+ *		FALSE if the caller has to destroy it
+ */
+extern Bool amdgpu_bo_cache_put(struct amdgpu_buffer *bo);
+
+/* Free BOs which have been sitting in the cache for longer than
+ * AMDGPU_BO_CACHE_TIMEOUT, called from the BlockHandler
+ */
+extern void amdgpu_bo_cache_expire(ScrnInfoPtr pScrn);
+
+#endif /* AMDGPU_BO_CACHE_H */
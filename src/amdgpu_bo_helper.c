@@ -23,12 +23,240 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <errno.h>
+#ifdef HAVE_DMA_BUF_EXPORT_SYNC_FILE
+#include <linux/dma-buf.h>
+#endif
 #include <gbm.h>
 #include "amdgpu_drv.h"
 #include "amdgpu_bo_helper.h"
 #include "amdgpu_pixmap.h"
 
+/* Unused amdgpu_buffer headers, linked through destroy_link. They don't
+ * belong to any screen, so a single pool serves all of them.
+ */
+static struct xorg_list amdgpu_bo_header_pool = {
+	&amdgpu_bo_header_pool, &amdgpu_bo_header_pool
+};
+static unsigned amdgpu_bo_header_pool_size;
+
+unsigned long amdgpu_heap_allocs;
+
+struct amdgpu_buffer *amdgpu_bo_header_alloc(void)
+{
+	struct amdgpu_buffer *bo;
+
+	if (xorg_list_is_empty(&amdgpu_bo_header_pool)) {
+		amdgpu_heap_allocs++;
+		return calloc(1, sizeof(struct amdgpu_buffer));
+	}
+
+	bo = xorg_list_entry(amdgpu_bo_header_pool.next, struct amdgpu_buffer,
+			     destroy_link);
+	xorg_list_del(&bo->destroy_link);
+	amdgpu_bo_header_pool_size--;
+	memset(bo, 0, sizeof(*bo));
+
+	return bo;
+}
+
+void amdgpu_bo_header_free(struct amdgpu_buffer *bo)
+{
+	if (amdgpu_bo_header_pool_size == AMDGPU_BO_HEADER_POOL_MAX) {
+		free(bo);
+		return;
+	}
+
+	xorg_list_add(&bo->destroy_link, &amdgpu_bo_header_pool);
+	amdgpu_bo_header_pool_size++;
+}
+
+void amdgpu_heap_alloc_report(ScrnInfoPtr pScrn)
+{
+	static CARD32 last_report;
+	static unsigned long last_allocs;
+	CARD32 now = GetTimeInMillis();
+	CARD32 elapsed = now - last_report;
+
+	if (elapsed < 1000)
+		return;
+
+	if (amdgpu_heap_allocs != last_allocs)
+		xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
+			       "%lu driver heap allocations/s\n",
+			       (amdgpu_heap_allocs - last_allocs) * 1000 / elapsed);
+
+	last_report = now;
+	last_allocs = amdgpu_heap_allocs;
+}
+
+/* Whether the CPU may access a BO. DRI2 depth and stencil buffers are only
+ * accessed by the GPU, and the policy can keep the CPU away from others.
+ */
+static Bool amdgpu_bo_cpu_access(AMDGPUInfoPtr info, int usage_hint,
+				 enum amdgpu_bo_usage usage)
+{
+	return !(usage_hint & AMDGPU_CREATE_PIXMAP_DEPTH) &&
+		amdgpu_bo_placement_policy(info, usage)->cpu_access;
+}
+
+/* Tiling mode for BOs allocated with amdgpu_bo_open, 0 for linear. BOs
+ * allocated by GBM get a tiling mode from Mesa instead.
+ *
+ * Without addrlib we can't work out the macro tile parameters of 2D tiling,
+ * but 1D tiling only needs the micro tile mode. That's not what GBM picks
+ * for the front buffer, DRI2 checks the tiling before flips and exchanges.
+ * BOs which are mapped by the CPU or read by another GPU have to stay linear,
+ * without glamor that's all of them except DRI2 depth and stencil buffers.
+ * Those are never accessed by the CPU, so with GBM they're always allocated
+ * by amdgpu_gbm_bo_create_flags and get depth micro tiling from here.
+ */
+static uint64_t amdgpu_bo_tiling_info(ScrnInfoPtr pScrn, int usage_hint,
+				      enum amdgpu_bo_usage usage)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	if (!info->have_tiling_info ||
+	    (usage_hint & AMDGPU_CREATE_PIXMAP_LINEAR) ||
+	    !amdgpu_bo_placement_policy(info, usage)->tiled)
+		return 0;
+
+	if (usage_hint & AMDGPU_CREATE_PIXMAP_DEPTH)
+		return AMDGPU_TILING_SET(ARRAY_MODE, AMDGPU_ARRAY_1D_TILED_THIN1) |
+			AMDGPU_TILING_SET(MICRO_TILE_MODE, AMDGPU_MICRO_TILE_DEPTH);
+
+	if (!info->use_glamor)
+		return 0;
+
+	return AMDGPU_TILING_SET(ARRAY_MODE, AMDGPU_ARRAY_1D_TILED_THIN1) |
+		AMDGPU_TILING_SET(MICRO_TILE_MODE, AMDGPU_MICRO_TILE_DISPLAY);
+}
+
+/* Store the tiling mode with the BO, so that the kernel can scan it out and
+ * Mesa lays out its own view of it the same way
+ */
+static Bool amdgpu_bo_set_tiling(struct amdgpu_buffer *bo,
+				 uint64_t tiling_info)
+{
+	struct amdgpu_bo_metadata metadata;
+
+	memset(&metadata, 0, sizeof(metadata));
+	metadata.tiling_info = tiling_info;
+
+	return amdgpu_bo_set_metadata(bo->bo.amdgpu, &metadata) == 0;
+}
+
+static Bool amdgpu_bo_get_tiling(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo,
+				 uint64_t *tiling_info)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	if (bo->flags & (AMDGPU_BO_FLAGS_GBM | AMDGPU_BO_FLAGS_USERPTR)) {
+		struct drm_amdgpu_gem_metadata args;
+
+		memset(&args, 0, sizeof(args));
+		if (!amdgpu_bo_get_handle(bo, &args.handle))
+			return FALSE;
+		args.op = AMDGPU_GEM_METADATA_OP_GET_METADATA;
+
+		if (drmCommandWriteRead(info->dri2.drm_fd, DRM_AMDGPU_GEM_METADATA,
+					&args, sizeof(args)))
+			return FALSE;
+
+		*tiling_info = args.data.tiling_info;
+	} else {
+		struct amdgpu_bo_info bo_info;
+
+		if (amdgpu_bo_query_info(bo->bo.amdgpu, &bo_info))
+			return FALSE;
+
+		*tiling_info = bo_info.metadata.tiling_info;
+	}
+
+	return TRUE;
+}
+
+Bool amdgpu_bo_same_tiling(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo1,
+			   struct amdgpu_buffer *bo2)
+{
+	uint64_t tiling_info1, tiling_info2;
+
+	if (!bo1 || !bo2)
+		return FALSE;
+
+	if (bo1 == bo2)
+		return TRUE;
+
+	if (!amdgpu_bo_get_tiling(pScrn, bo1, &tiling_info1) ||
+	    !amdgpu_bo_get_tiling(pScrn, bo2, &tiling_info2))
+		return FALSE;
+
+	return tiling_info1 == tiling_info2;
+}
+
+#ifdef GBM_BO_IMPORT_FD
+
+/* GBM always allocates in VRAM, doesn't take AMDGPU_GEM_CREATE_* flags and
+ * picks its own tiling mode, so allocate the BO ourselves and import it into
+ * GBM via a dma-buf. Mesa takes the tiling mode from the BO metadata.
+ *
+ * *tiling_info is cleared if the tiling mode couldn't be stored.
+ */
+static struct gbm_bo *amdgpu_gbm_bo_create_flags(ScrnInfoPtr pScrn, int width,
+						 int height, unsigned cpp,
+						 uint32_t format, uint32_t bo_use,
+						 uint32_t domain,
+						 uint64_t alloc_flags,
+						 uint64_t *tiling_info)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	AMDGPUEntPtr pAMDGPUEnt = AMDGPUEntPriv(pScrn);
+	unsigned pitch = cpp *
+		AMDGPU_ALIGN(width, drmmode_get_pitch_align(pScrn, cpp));
+	int aligned_height = height;
+	struct gbm_import_fd_data fd_data;
+	struct amdgpu_buffer *buffer;
+	struct gbm_bo *bo;
+	uint32_t fd;
+
+	if (*tiling_info)
+		aligned_height = AMDGPU_ALIGN(height, AMDGPU_MICRO_TILE_HEIGHT);
+
+	buffer = amdgpu_bo_open(pAMDGPUEnt->pDev, pitch * aligned_height, 4096,
+				domain, alloc_flags);
+	if (!buffer)
+		return NULL;
+
+	if (*tiling_info && !amdgpu_bo_set_tiling(buffer, *tiling_info))
+		*tiling_info = 0;
+
+	if (amdgpu_bo_export(buffer->bo.amdgpu,
+			     amdgpu_bo_handle_type_dma_buf_fd, &fd)) {
+		amdgpu_bo_unref(&buffer);
+		return NULL;
+	}
+
+	/* The dma-buf keeps the BO alive, GBM gets its own handle for it */
+	amdgpu_bo_unref(&buffer);
+
+	fd_data.fd = fd;
+	fd_data.width = width;
+	fd_data.height = height;
+	fd_data.stride = pitch;
+	fd_data.format = format;
+	bo = gbm_bo_import(info->gbm, GBM_BO_IMPORT_FD, &fd_data,
+			   bo_use & ~GBM_BO_USE_SCANOUT);
+	close(fd);
+
+	return bo;
+}
+
+#endif /* GBM_BO_IMPORT_FD */
+
 /* Calculate appropriate pitch for a pixmap and allocate a BO that can hold it.
  */
 struct amdgpu_buffer *amdgpu_alloc_pixmap_bo(ScrnInfoPtr pScrn, int width,
@@ -37,6 +265,21 @@ struct amdgpu_buffer *amdgpu_alloc_pixmap_bo(ScrnInfoPtr pScrn, int width,
 {
 	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
 	struct amdgpu_buffer *pixmap_buffer;
+	struct amdgpu_bo_cache_key key;
+	unsigned cpp = (bitsPerPixel + 7) / 8;
+	enum amdgpu_bo_usage usage = amdgpu_bo_placement_usage(usage_hint);
+
+	memset(&key, 0, sizeof(key));
+
+	if (usage_hint & AMDGPU_CREATE_PIXMAP_DRI2) {
+		struct amdgpu_bo_predict_req req = {
+			width, height, depth, usage_hint, bitsPerPixel
+		};
+
+		pixmap_buffer = amdgpu_bo_predict_get(pScrn, &req, new_pitch);
+		if (pixmap_buffer)
+			return pixmap_buffer;
+	}
 
 	if (info->gbm) {
 		uint32_t bo_use = GBM_BO_USE_RENDERING;
@@ -66,12 +309,6 @@ struct amdgpu_buffer *amdgpu_alloc_pixmap_bo(ScrnInfoPtr pScrn, int width,
 			return NULL;
 		}
 
-		pixmap_buffer = (struct amdgpu_buffer *)calloc(1, sizeof(struct amdgpu_buffer));
-		if (!pixmap_buffer) {
-			return NULL;
-		}
-		pixmap_buffer->ref_count = 1;
-
 		if ( bitsPerPixel == pScrn->bitsPerPixel)
 			bo_use |= GBM_BO_USE_SCANOUT;
 
@@ -81,38 +318,173 @@ struct amdgpu_buffer *amdgpu_alloc_pixmap_bo(ScrnInfoPtr pScrn, int width,
 		}
 #endif
 
-		if (usage_hint & AMDGPU_CREATE_PIXMAP_LINEAR) {
+		if ((usage_hint & AMDGPU_CREATE_PIXMAP_LINEAR) ||
+		    !amdgpu_bo_placement_policy(info, usage)->tiled) {
 			bo_use |= GBM_BO_USE_LINEAR;
 		}
 
-		pixmap_buffer->bo.gbm = gbm_bo_create(info->gbm, width, height,
-						      gbm_format,
-						      bo_use);
-		if (!pixmap_buffer->bo.gbm) {
-			free(pixmap_buffer);
-			return NULL;
-		}
+		key.size = width * height * cpp;
+		key.width = width;
+		key.height = height;
+		key.format = gbm_format;
+		key.usage = bo_use;
+		key.domain = amdgpu_bo_placement_domain(pScrn, usage, key.size);
+#ifdef GBM_BO_IMPORT_FD
+		/* BOs which the CPU never accesses, such as DRI2 depth and
+		 * stencil buffers, can live in the CPU invisible part of VRAM,
+		 * but only if we allocate them ourselves
+		 */
+		if (key.domain == AMDGPU_GEM_DOMAIN_VRAM &&
+		    usage != AMDGPU_BO_USAGE_SCANOUT &&
+		    !amdgpu_bo_cpu_access(info, usage_hint, usage))
+			key.alloc_flags = AMDGPU_GEM_CREATE_NO_CPU_ACCESS;
 
-		pixmap_buffer->flags |= AMDGPU_BO_FLAGS_GBM;
+		/* So do GTT BOs. Then the tiling mode is up to us as well */
+		if (key.alloc_flags || key.domain != AMDGPU_GEM_DOMAIN_VRAM)
+			key.tiling_info = amdgpu_bo_tiling_info(pScrn, usage_hint,
+								usage);
+#endif
+
+		pixmap_buffer = amdgpu_bo_cache_get(pScrn, &key);
+		if (!pixmap_buffer) {
+			pixmap_buffer = amdgpu_bo_header_alloc();
+			if (!pixmap_buffer) {
+				return NULL;
+			}
+			pixmap_buffer->ref_count = 1;
+
+#ifdef GBM_BO_IMPORT_FD
+			if (key.alloc_flags || key.domain != AMDGPU_GEM_DOMAIN_VRAM)
+				pixmap_buffer->bo.gbm =
+					amdgpu_gbm_bo_create_flags(pScrn, width, height,
+								   cpp, gbm_format,
+								   bo_use, key.domain,
+								   key.alloc_flags,
+								   &key.tiling_info);
+			else
+#endif
+			if (key.domain == AMDGPU_GEM_DOMAIN_VRAM)
+				pixmap_buffer->bo.gbm = gbm_bo_create(info->gbm, width,
+								      height,
+								      gbm_format,
+								      bo_use);
+#ifdef GBM_BO_IMPORT_FD
+			/* Fall back to GTT if we're out of VRAM */
+			if (!pixmap_buffer->bo.gbm && usage != AMDGPU_BO_USAGE_SCANOUT &&
+			    key.domain == AMDGPU_GEM_DOMAIN_VRAM) {
+				key.domain = AMDGPU_GEM_DOMAIN_GTT;
+				key.alloc_flags = 0;
+				key.tiling_info = amdgpu_bo_tiling_info(pScrn,
+									usage_hint,
+									usage);
+				pixmap_buffer->bo.gbm =
+					amdgpu_gbm_bo_create_flags(pScrn, width, height,
+								   cpp, gbm_format,
+								   bo_use, key.domain,
+								   key.alloc_flags,
+								   &key.tiling_info);
+			}
+#endif
+			if (!pixmap_buffer->bo.gbm) {
+				amdgpu_bo_header_free(pixmap_buffer);
+				return NULL;
+			}
+
+			pixmap_buffer->flags |= AMDGPU_BO_FLAGS_GBM;
+			pixmap_buffer->size = gbm_bo_get_stride(pixmap_buffer->bo.gbm) *
+				height;
+			pixmap_buffer->cache_key = key;
+		}
+		pixmap_buffer->domain = key.domain;
 
 		if (new_pitch)
 			*new_pitch = gbm_bo_get_stride(pixmap_buffer->bo.gbm);
 	} else {
 		AMDGPUEntPtr pAMDGPUEnt = AMDGPUEntPriv(pScrn);
-		unsigned cpp = (bitsPerPixel + 7) / 8;
 		unsigned pitch = cpp *
 			AMDGPU_ALIGN(width, drmmode_get_pitch_align(pScrn, cpp));
+		uint64_t tiling_info = amdgpu_bo_tiling_info(pScrn, usage_hint,
+							     usage);
+		int aligned_height = height;
+
+		/* Without glamor, fb renders to the BO through a CPU mapping.
+		 * With glamor, or if the policy says so, it's only accessed by
+		 * the GPU, so it can live in the CPU invisible part of VRAM.
+		 */
+		uint64_t alloc_flags =
+			(info->use_glamor ||
+			 !amdgpu_bo_cpu_access(info, usage_hint, usage)) ?
+			AMDGPU_GEM_CREATE_NO_CPU_ACCESS :
+			AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED;
+
+		/* The pitch alignment is a multiple of the micro tile width
+		 * already, only the height needs padding to whole micro tiles
+		 */
+		if (tiling_info)
+			aligned_height = AMDGPU_ALIGN(height, AMDGPU_MICRO_TILE_HEIGHT);
+
+		key.size = pitch * aligned_height;
+		key.tiling_info = tiling_info;
+		key.domain = amdgpu_bo_placement_domain(pScrn, usage, key.size);
+		if (key.domain == AMDGPU_GEM_DOMAIN_VRAM)
+			key.alloc_flags = alloc_flags;
+
+		pixmap_buffer = amdgpu_bo_cache_get(pScrn, &key);
+		if (!pixmap_buffer) {
+			pixmap_buffer = amdgpu_bo_open(pAMDGPUEnt->pDev, key.size,
+						       4096, key.domain,
+						       key.alloc_flags);
+			/* Fall back to GTT if we're out of VRAM */
+			if (!pixmap_buffer && key.domain == AMDGPU_GEM_DOMAIN_VRAM &&
+			    usage != AMDGPU_BO_USAGE_SCANOUT) {
+				key.domain = AMDGPU_GEM_DOMAIN_GTT;
+				key.alloc_flags = 0;
+				pixmap_buffer = amdgpu_bo_open(pAMDGPUEnt->pDev,
+							       key.size, 4096,
+							       key.domain, 0);
+			}
+			if (!pixmap_buffer)
+				return NULL;
 
-		pixmap_buffer = amdgpu_bo_open(pAMDGPUEnt->pDev, pitch * height,
-					       4096, AMDGPU_GEM_DOMAIN_VRAM);
+			if (tiling_info &&
+			    !amdgpu_bo_set_tiling(pixmap_buffer, tiling_info))
+				/* Without metadata everybody treats it as linear */
+				key.tiling_info = 0;
+
+			pixmap_buffer->cache_key = key;
+		}
+		pixmap_buffer->domain = key.domain;
 
 		if (new_pitch)
 			*new_pitch = pitch;
 	}
 
+	pixmap_buffer->scrn = pScrn;
+	pixmap_buffer->usage = usage;
 	return pixmap_buffer;
 }
 
+void amdgpu_bo_map_init(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	xorg_list_init(&info->bo_map_lru);
+	info->bo_map_size = 0;
+	info->bo_map_budget = info->vram_visible_size / 4;
+}
+
+/* Unmap the least recently released mappings until we're within budget */
+static void amdgpu_bo_map_trim(AMDGPUInfoPtr info)
+{
+	while (info->bo_map_size > info->bo_map_budget &&
+	       !xorg_list_is_empty(&info->bo_map_lru)) {
+		struct amdgpu_buffer *bo = xorg_list_entry(info->bo_map_lru.prev,
+							   struct amdgpu_buffer,
+							   map_lru);
+		amdgpu_bo_unmap(bo);
+	}
+}
+
 int amdgpu_bo_map(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo)
 {
 	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
@@ -121,41 +493,81 @@ int amdgpu_bo_map(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo)
 	if (info->use_glamor)
 		return 0;
 
+	if (bo->cpu_ptr) {
+		if (bo->scrn && bo->map_count++ == 0) {
+			xorg_list_del(&bo->map_lru);
+			amdgpu_bo_placement_cpu_map(pScrn, bo);
+		}
+		return 0;
+	}
+
 	if (bo->flags & AMDGPU_BO_FLAGS_GBM) {
-		uint32_t handle, stride, height;
-		union drm_amdgpu_gem_mmap args;
+		uint32_t stride, height;
 		int fd;
 		void *ptr;
 
-		handle = gbm_bo_get_handle(bo->bo.gbm).u32;
 		stride = gbm_bo_get_stride(bo->bo.gbm);
 		height = gbm_bo_get_height(bo->bo.gbm);
 		fd = info->dri2.drm_fd;
 
-		memset(&args, 0, sizeof(union drm_amdgpu_gem_mmap));
-		args.in.handle = handle;
+		if (!bo->mmap_offset) {
+			union drm_amdgpu_gem_mmap args;
 
-		ret = drmCommandWriteRead(fd, DRM_AMDGPU_GEM_MMAP,
-					&args, sizeof(args));
-		if (ret) {
-			ErrorF("Failed to get the mmap offset\n");
-			return ret;
+			memset(&args, 0, sizeof(union drm_amdgpu_gem_mmap));
+			if (!amdgpu_bo_get_handle(bo, &args.in.handle))
+				return -1;
+
+			ret = drmCommandWriteRead(fd, DRM_AMDGPU_GEM_MMAP,
+						&args, sizeof(args));
+			if (ret) {
+				ErrorF("Failed to get the mmap offset\n");
+				return ret;
+			}
+
+			bo->mmap_offset = args.out.addr_ptr;
 		}
 
 		ptr = mmap(NULL, stride * height,
 			PROT_READ | PROT_WRITE, MAP_SHARED,
-			fd, args.out.addr_ptr);
+			fd, bo->mmap_offset);
 
-		if (ptr == NULL) {
+		if (ptr == MAP_FAILED) {
 			ErrorF("Failed to mmap the bo\n");
 			return -1;
 		}
 
 		bo->cpu_ptr = ptr;
-	} else
+		bo->map_size = stride * height;
+	} else {
 		ret = amdgpu_bo_cpu_map(bo->bo.amdgpu, &bo->cpu_ptr);
+		if (ret)
+			return ret;
 
-	return ret;
+		bo->map_size = bo->size;
+	}
+
+	bo->scrn = pScrn;
+	bo->map_count = 1;
+	info->bo_map_size += bo->map_size;
+	amdgpu_bo_placement_cpu_map(pScrn, bo);
+	amdgpu_bo_map_trim(info);
+
+	return 0;
+}
+
+void amdgpu_bo_map_release(struct amdgpu_buffer *bo)
+{
+	AMDGPUInfoPtr info;
+
+	if (!bo->cpu_ptr || !bo->scrn || bo->map_count == 0)
+		return;
+
+	if (--bo->map_count)
+		return;
+
+	info = AMDGPUPTR(bo->scrn);
+	xorg_list_add(&bo->map_lru, &info->bo_map_lru);
+	amdgpu_bo_map_trim(info);
 }
 
 void amdgpu_bo_unmap(struct amdgpu_buffer *bo)
@@ -170,12 +582,25 @@ void amdgpu_bo_unmap(struct amdgpu_buffer *bo)
 		munmap(bo->cpu_ptr, stride * height);
 	} else
 		amdgpu_bo_cpu_unmap(bo->bo.amdgpu);
+
+	if (bo->scrn && bo->map_size) {
+		AMDGPUInfoPtr info = AMDGPUPTR(bo->scrn);
+
+		if (bo->map_count == 0)
+			xorg_list_del(&bo->map_lru);
+		info->bo_map_size -= bo->map_size;
+	}
+
+	bo->cpu_ptr = NULL;
+	bo->map_count = 0;
+	bo->map_size = 0;
 }
 
 struct amdgpu_buffer *amdgpu_bo_open(amdgpu_device_handle pDev,
 				       uint32_t alloc_size,
 				       uint32_t phys_alignment,
-				       uint32_t domains)
+				       uint32_t domains,
+				       uint64_t flags)
 {
 	struct amdgpu_bo_alloc_request alloc_request;
 	struct amdgpu_bo_alloc_result buffer;
@@ -184,7 +609,7 @@ struct amdgpu_buffer *amdgpu_bo_open(amdgpu_device_handle pDev,
 	memset(&alloc_request, 0, sizeof(struct amdgpu_bo_alloc_request));
 	memset(&buffer, 0, sizeof(struct amdgpu_bo_alloc_result));
 
-	bo = (struct amdgpu_buffer *)calloc(1, sizeof(struct amdgpu_buffer));
+	bo = amdgpu_bo_header_alloc();
 	if (bo == NULL) {
 		return NULL;
 	}
@@ -192,14 +617,16 @@ struct amdgpu_buffer *amdgpu_bo_open(amdgpu_device_handle pDev,
 	alloc_request.alloc_size = alloc_size;
 	alloc_request.phys_alignment = phys_alignment;
 	alloc_request.preferred_heap = domains;
+	alloc_request.flags = flags;
 
 	if (amdgpu_bo_alloc(pDev, &alloc_request, &buffer)) {
-		free(bo);
+		amdgpu_bo_header_free(bo);
 		return NULL;
 	}
 
 	bo->bo.amdgpu = buffer.buf_handle;
 	bo->ref_count = 1;
+	bo->size = alloc_size;
 
 	return bo;
 }
@@ -218,15 +645,263 @@ void amdgpu_bo_unref(struct amdgpu_buffer **buffer)
 		return;
 	}
 
-	amdgpu_bo_unmap(buf);
+	if (buf->flags & AMDGPU_BO_FLAGS_IMPORTED) {
+		xorg_list_del(&buf->import_link);
+		buf->flags &= ~AMDGPU_BO_FLAGS_IMPORTED;
+	}
 
-	if (buf->flags & AMDGPU_BO_FLAGS_GBM) {
-		gbm_bo_destroy(buf->bo.gbm);
+	if (!amdgpu_bo_cache_put(buf))
+		amdgpu_bo_queue_destroy(buf);
+	*buffer = NULL;
+}
+
+Bool amdgpu_bo_get_handle(struct amdgpu_buffer *bo, uint32_t *handle)
+{
+	if (!bo->kms_handle) {
+		if (bo->flags & AMDGPU_BO_FLAGS_GBM) {
+			bo->kms_handle = gbm_bo_get_handle(bo->bo.gbm).u32;
+		} else if (amdgpu_bo_export(bo->bo.amdgpu,
+					    amdgpu_bo_handle_type_kms,
+					    &bo->kms_handle)) {
+			bo->kms_handle = 0;
+			return FALSE;
+		}
+	}
+
+	*handle = bo->kms_handle;
+	return TRUE;
+}
+
+Bool amdgpu_bo_get_flink_name(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo,
+			      uint32_t *name)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	if (!bo->flink_name) {
+		struct drm_gem_flink flink;
+
+		if (!amdgpu_bo_get_handle(bo, &flink.handle))
+			return FALSE;
+
+		if (ioctl(info->dri2.drm_fd, DRM_IOCTL_GEM_FLINK, &flink) < 0)
+			return FALSE;
+
+		bo->flink_name = flink.name;
+		bo->flags |= AMDGPU_BO_FLAGS_SHARED;
+	}
+
+	*name = bo->flink_name;
+	return TRUE;
+}
+
+int amdgpu_bo_get_dmabuf_fd(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	if (!(bo->flags & AMDGPU_BO_FLAGS_DMABUF)) {
+		uint32_t handle;
+
+		if (!amdgpu_bo_get_handle(bo, &handle))
+			return -1;
+
+		if (drmPrimeHandleToFD(info->dri2.drm_fd, handle, DRM_CLOEXEC,
+				       &bo->dmabuf_fd))
+			return -1;
+
+		bo->flags |= AMDGPU_BO_FLAGS_DMABUF | AMDGPU_BO_FLAGS_SHARED;
+	}
+
+	return dup(bo->dmabuf_fd);
+}
+
+static Bool amdgpu_bo_wait(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo,
+			   uint64_t timeout)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	if (bo->flags & (AMDGPU_BO_FLAGS_GBM | AMDGPU_BO_FLAGS_USERPTR)) {
+		union drm_amdgpu_gem_wait_idle args;
+
+		memset(&args, 0, sizeof(args));
+		if (!amdgpu_bo_get_handle(bo, &args.in.handle))
+			return TRUE;
+		args.in.timeout = timeout;
+
+		if (drmCommandWriteRead(info->dri2.drm_fd, DRM_AMDGPU_GEM_WAIT_IDLE,
+					&args, sizeof(args)))
+			return TRUE;
+
+		return args.out.status == 0;
 	} else {
-		amdgpu_bo_free(buf->bo.amdgpu);
+		bool busy;
+
+		if (amdgpu_bo_wait_for_idle(bo->bo.amdgpu, timeout, &busy))
+			return TRUE;
+
+		return !busy;
 	}
-	free(buf);
-	*buffer = NULL;
+}
+
+Bool amdgpu_bo_is_idle(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo)
+{
+	return amdgpu_bo_wait(pScrn, bo, 0);
+}
+
+void amdgpu_bo_wait_idle(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo)
+{
+	amdgpu_bo_wait(pScrn, bo, AMDGPU_TIMEOUT_INFINITE);
+}
+
+int amdgpu_bo_export_sync_file(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo)
+{
+#ifdef HAVE_DMA_BUF_EXPORT_SYNC_FILE
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct dma_buf_export_sync_file args;
+	uint32_t handle;
+	int fd, ret, err;
+
+	if (bo->flags & AMDGPU_BO_FLAGS_USERPTR) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Use a dma-buf of our own, which is closed again right away. Going
+	 * through amdgpu_bo_get_dmabuf_fd would mark the BO shared and keep
+	 * it out of the BO cache.
+	 */
+	if (bo->flags & AMDGPU_BO_FLAGS_DMABUF) {
+		fd = bo->dmabuf_fd;
+	} else {
+		if (!amdgpu_bo_get_handle(bo, &handle)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		if (drmPrimeHandleToFD(info->dri2.drm_fd, handle, DRM_CLOEXEC,
+				       &fd))
+			return -1;
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.flags = DMA_BUF_SYNC_READ;
+	args.fd = -1;
+	ret = drmIoctl(fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &args);
+	err = errno;
+
+	if (!(bo->flags & AMDGPU_BO_FLAGS_DMABUF))
+		close(fd);
+
+	if (ret) {
+		errno = err;
+		return -1;
+	}
+
+	return args.fd;
+#else
+	errno = ENOTTY;
+	return -1;
+#endif
+}
+
+void amdgpu_bo_destroy_queue_init(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	xorg_list_init(&info->bo_destroy_queue);
+	info->bo_destroy_count = 0;
+	info->bo_destroy_enabled = TRUE;
+}
+
+void amdgpu_bo_destroy_queue_fini(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	if (!info->bo_destroy_enabled)
+		return;
+
+	amdgpu_bo_destroy_queue_drain(pScrn, TRUE);
+	info->bo_destroy_enabled = FALSE;
+}
+
+void amdgpu_bo_queue_destroy(struct amdgpu_buffer *bo)
+{
+	AMDGPUInfoPtr info;
+
+	/* We don't know the screen of BOs which weren't allocated or mapped
+	 * through it
+	 */
+	if (!bo->scrn) {
+		amdgpu_bo_destroy(bo);
+		return;
+	}
+
+	info = AMDGPUPTR(bo->scrn);
+	if (!info->bo_destroy_enabled) {
+		amdgpu_bo_destroy(bo);
+		return;
+	}
+
+	bo->destroy_time = GetTimeInMillis();
+	xorg_list_append(&bo->destroy_link, &info->bo_destroy_queue);
+
+	if (++info->bo_destroy_count > AMDGPU_BO_DESTROY_MAX) {
+		struct amdgpu_buffer *oldest =
+			xorg_list_entry(info->bo_destroy_queue.next,
+					struct amdgpu_buffer, destroy_link);
+
+		xorg_list_del(&oldest->destroy_link);
+		info->bo_destroy_count--;
+		amdgpu_bo_destroy(oldest);
+	}
+}
+
+void amdgpu_bo_destroy_queue_drain(ScrnInfoPtr pScrn, Bool all)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_buffer *bo, *tmp;
+	CARD32 now = GetTimeInMillis();
+	int checked = 0;
+
+	xorg_list_for_each_entry_safe(bo, tmp, &info->bo_destroy_queue,
+				      destroy_link) {
+		if (!all) {
+			if (checked++ == AMDGPU_BO_DESTROY_BATCH)
+				break;
+
+			/* Let the GPU finish with the BO first, within reason */
+			if ((CARD32)(now - bo->destroy_time) <
+			    AMDGPU_BO_DESTROY_TIMEOUT &&
+			    !amdgpu_bo_is_idle(pScrn, bo))
+				continue;
+		}
+
+		xorg_list_del(&bo->destroy_link);
+		info->bo_destroy_count--;
+		amdgpu_bo_destroy(bo);
+	}
+}
+
+void amdgpu_bo_destroy(struct amdgpu_buffer *buffer)
+{
+	amdgpu_bo_unmap(buffer);
+
+	if (buffer->fb_id)
+		drmModeRmFB(buffer->fb_fd, buffer->fb_id);
+
+	if (buffer->flags & AMDGPU_BO_FLAGS_DMABUF)
+		close(buffer->dmabuf_fd);
+
+	if (buffer->flags & AMDGPU_BO_FLAGS_GBM) {
+		gbm_bo_destroy(buffer->bo.gbm);
+	} else if (buffer->flags & AMDGPU_BO_FLAGS_USERPTR) {
+		struct drm_gem_close args = { .handle = buffer->kms_handle };
+
+		drmIoctl(AMDGPUPTR(buffer->scrn)->dri2.drm_fd,
+			 DRM_IOCTL_GEM_CLOSE, &args);
+	} else {
+		amdgpu_bo_free(buffer->bo.amdgpu);
+	}
+	amdgpu_bo_header_free(buffer);
 }
 
 int amdgpu_query_bo_size(amdgpu_bo_handle buf_handle, uint32_t *size)
@@ -246,6 +921,7 @@ int amdgpu_query_bo_size(amdgpu_bo_handle buf_handle, uint32_t *size)
 
 int amdgpu_query_heap_size(amdgpu_device_handle pDev,
 			    uint32_t heap,
+			    uint32_t flags,
 			    uint64_t *heap_size,
 			    uint64_t *max_allocation)
 {
@@ -253,7 +929,7 @@ int amdgpu_query_heap_size(amdgpu_device_handle pDev,
 	memset(&heap_info, 0, sizeof(struct amdgpu_heap_info));
 	int ret;
 
-	ret = amdgpu_query_heap_info(pDev, heap, 0, &heap_info);
+	ret = amdgpu_query_heap_info(pDev, heap, flags, &heap_info);
 	if (ret) {
 		*heap_size = 0;
 		*max_allocation = 0;
@@ -272,30 +948,145 @@ struct amdgpu_buffer *amdgpu_gem_bo_open_prime(amdgpu_device_handle pDev,
 	struct amdgpu_buffer *bo = NULL;
 	struct amdgpu_bo_import_result buffer = {0};
 
-	bo = (struct amdgpu_buffer *)calloc(1, sizeof(struct amdgpu_buffer));
+	bo = amdgpu_bo_header_alloc();
 	if (bo == NULL) {
 		return NULL;
 	}
 
 	if (amdgpu_bo_import(pDev, amdgpu_bo_handle_type_dma_buf_fd,
 			     (uint32_t)fd_handle, &buffer)) {
-		free(bo);
+		amdgpu_bo_header_free(bo);
 		return FALSE;
 	}
 	bo->bo.amdgpu = buffer.buf_handle;
 	bo->ref_count = 1;
+	bo->size = size;
+
+	return bo;
+}
+
+struct amdgpu_buffer *amdgpu_bo_from_user_mem(ScrnInfoPtr pScrn, void *cpu,
+					      uint32_t size)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct drm_amdgpu_gem_userptr args;
+	struct amdgpu_buffer *bo;
+
+	memset(&args, 0, sizeof(args));
+	args.addr = (uintptr_t)cpu;
+	args.size = size;
+	/* Unlike amdgpu_create_bo_from_user_mem, don't restrict this to
+	 * anonymous memory, SHM segments are backed by shmem files
+	 */
+	args.flags = AMDGPU_GEM_USERPTR_REGISTER | AMDGPU_GEM_USERPTR_VALIDATE;
+
+	if (drmCommandWriteRead(info->dri2.drm_fd, DRM_AMDGPU_GEM_USERPTR,
+				&args, sizeof(args)))
+		return NULL;
+
+	bo = amdgpu_bo_header_alloc();
+	if (!bo) {
+		struct drm_gem_close close_args = { .handle = args.handle };
+
+		drmIoctl(info->dri2.drm_fd, DRM_IOCTL_GEM_CLOSE, &close_args);
+		return NULL;
+	}
+
+	bo->flags = AMDGPU_BO_FLAGS_USERPTR;
+	bo->kms_handle = args.handle;
+	bo->ref_count = 1;
+	bo->size = size;
+	bo->scrn = pScrn;
+
+	return bo;
+}
+
+/* Only dma-bufs backed by the dma-buf pseudo filesystem have an inode
+ * of their own, older kernels use a single anonymous inode for all of them
+ */
+#ifndef DMA_BUF_MAGIC
+#define DMA_BUF_MAGIC	0x444d4142
+#endif
+
+void amdgpu_bo_import_init(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	xorg_list_init(&info->bo_imports);
+	info->bo_imports_enabled = TRUE;
+	info->bo_import_hits = info->bo_import_misses = 0;
+}
+
+void amdgpu_bo_import_fini(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_buffer *bo, *tmp;
+
+	if (!info->bo_imports_enabled)
+		return;
+
+	xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
+		       "dma-buf import cache: %lu hits, %lu misses\n",
+		       info->bo_import_hits, info->bo_import_misses);
+
+	/* BOs still referenced may outlive the list head in info */
+	xorg_list_for_each_entry_safe(bo, tmp, &info->bo_imports, import_link) {
+		xorg_list_del(&bo->import_link);
+		xorg_list_init(&bo->import_link);
+		bo->flags &= ~AMDGPU_BO_FLAGS_IMPORTED;
+	}
+
+	info->bo_imports_enabled = FALSE;
+}
+
+struct amdgpu_buffer *amdgpu_bo_import_dmabuf(ScrnInfoPtr pScrn, int fd,
+					      uint32_t size)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	AMDGPUEntPtr pAMDGPUEnt = AMDGPUEntPriv(pScrn);
+	struct amdgpu_buffer *bo;
+	struct statfs sfs;
+	struct stat st;
+
+	if (!info->bo_imports_enabled ||
+	    fstatfs(fd, &sfs) || sfs.f_type != DMA_BUF_MAGIC ||
+	    fstat(fd, &st))
+		return amdgpu_gem_bo_open_prime(pAMDGPUEnt->pDev, fd, size);
+
+	/* Our import holds a reference to the dma-buf, so its inode can't be
+	 * reused for another buffer while the BO is in the list
+	 */
+	xorg_list_for_each_entry(bo, &info->bo_imports, import_link) {
+		if (bo->import_ino == st.st_ino && bo->import_dev == st.st_dev) {
+			info->bo_import_hits++;
+			bo->ref_count++;
+			return bo;
+		}
+	}
+
+	info->bo_import_misses++;
+	bo = amdgpu_gem_bo_open_prime(pAMDGPUEnt->pDev, fd, size);
+	if (!bo)
+		return NULL;
+
+	bo->import_dev = st.st_dev;
+	bo->import_ino = st.st_ino;
+	bo->flags |= AMDGPU_BO_FLAGS_IMPORTED;
+	xorg_list_add(&bo->import_link, &info->bo_imports);
 
 	return bo;
 }
 
 #ifdef AMDGPU_PIXMAP_SHARING
 
-Bool amdgpu_share_pixmap_backing(struct amdgpu_buffer *bo, void **handle_p)
+Bool amdgpu_share_pixmap_backing(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo,
+				 void **handle_p)
 {
 	int handle;
 
-	amdgpu_bo_export(bo->bo.amdgpu, amdgpu_bo_handle_type_dma_buf_fd,
-			 (uint32_t *)&handle);
+	handle = amdgpu_bo_get_dmabuf_fd(pScrn, bo);
+	if (handle < 0)
+		return FALSE;
 
 	*handle_p = (void *)(long)handle;
 	return TRUE;
@@ -304,13 +1095,14 @@ Bool amdgpu_share_pixmap_backing(struct amdgpu_buffer *bo, void **handle_p)
 Bool amdgpu_set_shared_pixmap_backing(PixmapPtr ppix, void *fd_handle)
 {
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(ppix->drawable.pScreen);
-	AMDGPUEntPtr pAMDGPUEnt = AMDGPUEntPriv(pScrn);
 	struct amdgpu_buffer *pixmap_buffer = NULL;
 	int ihandle = (int)(long)fd_handle;
 	uint32_t size = ppix->devKind * ppix->drawable.height;
 
-	pixmap_buffer = amdgpu_gem_bo_open_prime(pAMDGPUEnt->pDev, ihandle, size);
+	/* The fd is ours to close either way */
+	pixmap_buffer = amdgpu_bo_import_dmabuf(pScrn, ihandle, size);
 	if (!pixmap_buffer) {
+		close(ihandle);
 		return FALSE;
 	}
 
@@ -25,15 +25,67 @@
 
 #include "amdgpu_drv.h"
 
+/* Unused amdgpu_buffer headers kept for reuse */
+#define AMDGPU_BO_HEADER_POOL_MAX	1024
+
+/* Heap allocations made for BO headers. Pixmap privates are part
+ * of the pixmap, so creating and destroying pixmaps doesn't add to this once
+ * the header pool has warmed up.
+ */
+extern unsigned long amdgpu_heap_allocs;
+
+/* helper function to get a zeroed amdgpu_buffer header from the pool
+ *
+ * \return	pointer to amdgpu_buffer on success
+		NULL on failure
+*/
+extern struct amdgpu_buffer *amdgpu_bo_header_alloc(void);
+
+/* helper function to return an amdgpu_buffer header to the pool
+ * \param	bo	- \c [in] amdgpu_buffer, no longer referencing a BO
+*/
+extern void amdgpu_bo_header_free(struct amdgpu_buffer *bo);
+
+/* helper function to log the rate of heap allocations, at most once a
+ * second, called from the BlockHandler
+ * \param	pScrn	- \c [in] screen
+*/
+extern void amdgpu_heap_alloc_report(ScrnInfoPtr pScrn);
+
 extern struct amdgpu_buffer *amdgpu_alloc_pixmap_bo(ScrnInfoPtr pScrn, int width,
 						     int height, int depth, int usage_hint,
 						     int bitsPerPixel, int *new_pitch);
 
+/* helper function to set up tracking of CPU mappings for a screen
+ * \param	pScrn	- \c [in] screen
+*/
+extern void amdgpu_bo_map_init(ScrnInfoPtr pScrn);
+
+/* helper function to map a BO for CPU access. The mapping is reused if the
+ * BO is still mapped, and stays valid until amdgpu_bo_map_release.
+ * \param	pScrn	- \c [in] screen
+ * \param	bo	- \c [in] amdgpu_buffer
+ *
+ * \return	0 on success
+ *		non-zero on failure
+*/
 extern int amdgpu_bo_map(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo);
 
+/* helper function to drop a reference to a CPU mapping. Mappings without
+ * references are kept around and unmapped least recently used first when
+ * the mapped size exceeds the budget.
+ * \param	bo	- \c [in] amdgpu_buffer
+*/
+extern void amdgpu_bo_map_release(struct amdgpu_buffer *bo);
+
+/* helper function to unmap a BO immediately, regardless of references
+ * \param	bo	- \c [in] amdgpu_buffer
+*/
 extern void amdgpu_bo_unmap(struct amdgpu_buffer *bo);
 
-extern Bool amdgpu_share_pixmap_backing(struct amdgpu_buffer *bo, void **handle_p);
+extern Bool amdgpu_share_pixmap_backing(ScrnInfoPtr pScrn,
+					struct amdgpu_buffer *bo,
+					void **handle_p);
 
 extern Bool
 amdgpu_set_shared_pixmap_backing(PixmapPtr ppix, void *fd_handle);
@@ -44,6 +96,7 @@ amdgpu_set_shared_pixmap_backing(PixmapPtr ppix, void *fd_handle);
  * \param	alloc_size	- \c [in] allocation size
  * \param	phys_alignment	- \c [in] requested alignment. 0 means no alignment requirement
  * \param	domains		- \c [in] GEM domains
+ * \param	flags		- \c [in] AMDGPU_GEM_CREATE_* flags, e.g. CPU access
  *
  * \return	pointer to amdgpu_buffer on success
  *		NULL on failure
@@ -51,7 +104,8 @@ amdgpu_set_shared_pixmap_backing(PixmapPtr ppix, void *fd_handle);
 extern struct amdgpu_buffer *amdgpu_bo_open(amdgpu_device_handle pDev,
 					      uint32_t alloc_size,
 					      uint32_t phys_alignment,
-					      uint32_t domains);
+					      uint32_t domains,
+					      uint64_t flags);
 
 /* helper function to add the ref_count of a amdgpu_buffer
  * \param	buffer	- \c [in] amdgpu_buffer
@@ -63,6 +117,111 @@ extern void amdgpu_bo_ref(struct amdgpu_buffer *buffer);
 */
 extern void amdgpu_bo_unref(struct amdgpu_buffer **buffer);
 
+/* helper function to free a amdgpu_buffer, bypassing the BO cache
+ * \param	buffer	- \c [in] amdgpu_buffer without references
+*/
+extern void amdgpu_bo_destroy(struct amdgpu_buffer *buffer);
+
+/* helper function to get the KMS handle of a BO, cached after the first call
+ * \param	bo	- \c [in] amdgpu_buffer
+ * \param	handle	- \c [out] KMS handle
+ *
+ * \return	TRUE on success
+ *		FALSE on failure
+*/
+extern Bool amdgpu_bo_get_handle(struct amdgpu_buffer *bo, uint32_t *handle);
+
+/* helper function to check whether two BOs have the same tiling mode. Before
+ * DC, page flips only change the scanout address, so a BO can only replace
+ * another one with the same layout.
+ * \param	pScrn	- \c [in] screen
+ * \param	bo1	- \c [in] amdgpu_buffer
+ * \param	bo2	- \c [in] amdgpu_buffer
+ *
+ * \return	TRUE if the tiling modes match
+ *		FALSE if they don't or can't be queried
+*/
+extern Bool amdgpu_bo_same_tiling(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo1,
+				  struct amdgpu_buffer *bo2);
+
+/* helper function to get the flink name of a BO, cached after the first call.
+ * Marks the BO as shared.
+ * \param	pScrn	- \c [in] screen
+ * \param	bo	- \c [in] amdgpu_buffer
+ * \param	name	- \c [out] flink name
+ *
+ * \return	TRUE on success
+ *		FALSE on failure
+*/
+extern Bool amdgpu_bo_get_flink_name(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo,
+				     uint32_t *name);
+
+/* helper function to get a dma-buf fd for a BO. The BO keeps a cached fd and
+ * is marked as shared, the caller gets a dup() of it which it has to close.
+ * \param	pScrn	- \c [in] screen
+ * \param	bo	- \c [in] amdgpu_buffer
+ *
+ * \return	dma-buf fd on success
+ *		-1 on failure
+*/
+extern int amdgpu_bo_get_dmabuf_fd(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo);
+
+/* BOs queued for destruction are freed from the BlockHandler, in batches of
+ * up to AMDGPU_BO_DESTROY_BATCH, once the GPU is done with them or they've
+ * been queued for AMDGPU_BO_DESTROY_TIMEOUT. At most AMDGPU_BO_DESTROY_MAX
+ * BOs are held back.
+ */
+#define AMDGPU_BO_DESTROY_BATCH		32
+#define AMDGPU_BO_DESTROY_TIMEOUT	100	/* ms */
+#define AMDGPU_BO_DESTROY_MAX		256
+
+/* helper function to check whether the GPU is done with a BO
+ * \param	pScrn	- \c [in] screen
+ * \param	bo	- \c [in] amdgpu_buffer
+ *
+ * \return	TRUE if idle or the state can't be queried
+ *		FALSE if still busy
+*/
+extern Bool amdgpu_bo_is_idle(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo);
+
+/* helper function to block until the GPU is done with a BO
+ * \param	pScrn	- \c [in] screen
+ * \param	bo	- \c [in] amdgpu_buffer
+*/
+extern void amdgpu_bo_wait_idle(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo);
+
+/* helper function to export the fences of pending writes to a BO as a
+ * sync_file
+ * \param	pScrn	- \c [in] screen
+ * \param	bo	- \c [in] amdgpu_buffer
+ *
+ * \return	sync_file fd, signalled once the writes have finished
+ *		-1 on failure, with errno set to ENOTTY if the kernel can't
+ *		export sync_files
+*/
+extern int amdgpu_bo_export_sync_file(ScrnInfoPtr pScrn,
+				      struct amdgpu_buffer *bo);
+
+extern void amdgpu_bo_destroy_queue_init(ScrnInfoPtr pScrn);
+
+/* helper function to free all queued BOs and destroy BOs immediately
+ * from now on
+ * \param	pScrn	- \c [in] screen
+*/
+extern void amdgpu_bo_destroy_queue_fini(ScrnInfoPtr pScrn);
+
+/* helper function to queue a amdgpu_buffer without references for
+ * destruction
+ * \param	bo	- \c [in] amdgpu_buffer
+*/
+extern void amdgpu_bo_queue_destroy(struct amdgpu_buffer *bo);
+
+/* helper function to free queued BOs
+ * \param	pScrn	- \c [in] screen
+ * \param	all	- \c [in] free all BOs, rather than one batch of idle ones
+*/
+extern void amdgpu_bo_destroy_queue_drain(ScrnInfoPtr pScrn, Bool all);
+
 /* helper function to query the buffer size
  * \param	buf_handle	- \c [in] amdgpu bo handle
  * \param	size		- \c [out] pointer to buffer size
@@ -76,6 +235,8 @@ int amdgpu_query_bo_size(amdgpu_bo_handle buf_handle, uint32_t *size);
 /* helper function to query the heap information
  * \param	pDev		- \c [in] amdgpu device handle
  * \param 	heap		- \c [in] heap type
+ * \param	flags		- \c [in] AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED for
+ *				  the CPU visible part of VRAM, 0 otherwise
  * \param	heap_size	- \c [out] theoretical max available memory
  * \param	max_allcoation	- \c [out] theoretical possible max. size of buffer
  *
@@ -85,9 +246,32 @@ int amdgpu_query_bo_size(amdgpu_bo_handle buf_handle, uint32_t *size);
 */
 int amdgpu_query_heap_size(amdgpu_device_handle pDev,
                             uint32_t heap,
+                            uint32_t flags,
                             uint64_t *heap_size,
                             uint64_t *max_allocation);
 
+/* helper function to set up the per-screen cache of dma-buf imports
+ * \param	pScrn	- \c [in] screen
+*/
+extern void amdgpu_bo_import_init(ScrnInfoPtr pScrn);
+
+/* helper function to report import cache statistics and stop caching
+ * \param	pScrn	- \c [in] screen
+*/
+extern void amdgpu_bo_import_fini(ScrnInfoPtr pScrn);
+
+/* helper function to import a dma-buf, reusing the amdgpu_buffer of an
+ * earlier import of the same dma-buf if it's still alive
+ * \param	pScrn	- \c [in] screen
+ * \param	fd	- \c [in] dma-buf fd, not consumed
+ * \param	size	- \c [in] buffer size
+ *
+ * \return	pointer to amdgpu_buffer with a new reference on success
+		NULL on failure
+*/
+extern struct amdgpu_buffer *amdgpu_bo_import_dmabuf(ScrnInfoPtr pScrn,
+						     int fd, uint32_t size);
+
 /* helper function to convert a DMA buf handle to a KMS handle
  * \param	pDev		- \c [in] amdgpu device handle
  * \param	fd_handle 	- \c [in] dma-buf fd handle
@@ -100,4 +284,16 @@ struct amdgpu_buffer *amdgpu_gem_bo_open_prime(amdgpu_device_handle pDev,
                                                  int fd_handle,
                                                  uint32_t size);
 
+/* helper function to wrap memory of the X server as a BO the GPU accesses
+ * directly
+ * \param	pScrn		- \c [in] screen
+ * \param	cpu		- \c [in] page aligned address
+ * \param	size		- \c [in] page aligned size
+ *
+ * \return	pointer to amdgpu_buffer on success
+		NULL on failure
+*/
+extern struct amdgpu_buffer *amdgpu_bo_from_user_mem(ScrnInfoPtr pScrn, void *cpu,
+					      uint32_t size);
+
 #endif /* AMDGPU_BO_HELPER_H */
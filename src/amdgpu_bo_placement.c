@@ -0,0 +1,341 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <xf86.h>
+#include "amdgpu_drv.h"
+#include "amdgpu_pixmap.h"
+#include "amdgpu_bo_placement.h"
+
+static const char *amdgpu_bo_usage_names[AMDGPU_BO_USAGE_COUNT] = {
+	[AMDGPU_BO_USAGE_DEFAULT] = "default",
+	[AMDGPU_BO_USAGE_SCRATCH] = "scratch",
+	[AMDGPU_BO_USAGE_BACKING] = "backing",
+	[AMDGPU_BO_USAGE_GLYPH] = "glyph",
+	[AMDGPU_BO_USAGE_SCANOUT] = "scanout",
+	[AMDGPU_BO_USAGE_DRI2] = "dri2",
+	[AMDGPU_BO_USAGE_SHARED] = "shared",
+};
+
+static const struct amdgpu_pixmap_policy
+amdgpu_pixmap_policy_defaults[AMDGPU_BO_USAGE_COUNT] = {
+	/*				 texture tiled  domain cpu   cache */
+	[AMDGPU_BO_USAGE_DEFAULT] =	{ TRUE,  TRUE,  0,     TRUE, TRUE },
+	[AMDGPU_BO_USAGE_SCRATCH] =	{ TRUE,  TRUE,  0,     TRUE, TRUE },
+	[AMDGPU_BO_USAGE_BACKING] =	{ TRUE,  TRUE,  0,     TRUE, TRUE },
+	[AMDGPU_BO_USAGE_GLYPH] =	{ TRUE,  TRUE,  0,     TRUE, TRUE },
+	/* The display engine can only scan out of VRAM */
+	[AMDGPU_BO_USAGE_SCANOUT] =	{ FALSE, TRUE,  AMDGPU_GEM_DOMAIN_VRAM,
+					  TRUE, TRUE },
+	[AMDGPU_BO_USAGE_DRI2] =	{ FALSE, TRUE,  0,     TRUE, TRUE },
+	/* Buffers shared with another GPU are mostly read by that one, which
+	 * doesn't know our tiling
+	 */
+	[AMDGPU_BO_USAGE_SHARED] =	{ FALSE, FALSE, AMDGPU_GEM_DOMAIN_GTT,
+					  TRUE, TRUE },
+};
+
+/* Apply one "<class>:<setting>[,<setting>...]" entry of Option
+ * "PixmapPolicy"
+ */
+static void amdgpu_pixmap_policy_parse(ScrnInfoPtr pScrn,
+				       struct amdgpu_pixmap_policy *policies,
+				       char *entry)
+{
+	struct amdgpu_pixmap_policy *policy = NULL;
+	char *settings, *setting, *saveptr;
+	int i;
+
+	settings = strchr(entry, ':');
+	if (settings)
+		*settings++ = '\0';
+
+	for (i = 0; i < AMDGPU_BO_USAGE_COUNT; i++) {
+		if (xf86NameCmp(entry, amdgpu_bo_usage_names[i]) == 0) {
+			policy = &policies[i];
+			break;
+		}
+	}
+
+	if (!policy || !settings) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			   "Ignoring invalid PixmapPolicy entry \"%s\"\n", entry);
+		return;
+	}
+
+	for (setting = strtok_r(settings, ",", &saveptr); setting;
+	     setting = strtok_r(NULL, ",", &saveptr)) {
+		if (xf86NameCmp(setting, "texture") == 0)
+			policy->texture = TRUE;
+		else if (xf86NameCmp(setting, "bo") == 0)
+			policy->texture = FALSE;
+		else if (xf86NameCmp(setting, "tiled") == 0)
+			policy->tiled = TRUE;
+		else if (xf86NameCmp(setting, "linear") == 0)
+			policy->tiled = FALSE;
+		else if (xf86NameCmp(setting, "vram") == 0)
+			policy->domain = AMDGPU_GEM_DOMAIN_VRAM;
+		else if (xf86NameCmp(setting, "gtt") == 0)
+			policy->domain = AMDGPU_GEM_DOMAIN_GTT;
+		else if (xf86NameCmp(setting, "auto") == 0)
+			policy->domain = 0;
+		else if (xf86NameCmp(setting, "cpu") == 0)
+			policy->cpu_access = TRUE;
+		else if (xf86NameCmp(setting, "nocpu") == 0)
+			policy->cpu_access = FALSE;
+		else if (xf86NameCmp(setting, "cache") == 0)
+			policy->cache = TRUE;
+		else if (xf86NameCmp(setting, "nocache") == 0)
+			policy->cache = FALSE;
+		else
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+				   "Ignoring unknown PixmapPolicy setting "
+				   "\"%s\" for %s pixmaps\n", setting, entry);
+	}
+}
+
+static void amdgpu_pixmap_policy_init(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_pixmap_policy *policies = info->placement.policy;
+	const char *option;
+	char *str, *entry, *saveptr;
+
+	memcpy(policies, amdgpu_pixmap_policy_defaults,
+	       sizeof(amdgpu_pixmap_policy_defaults));
+
+	option = xf86GetOptValString(info->Options, OPTION_PIXMAP_POLICY);
+	if (!option)
+		return;
+
+	str = strdup(option);
+	if (!str)
+		return;
+
+	for (entry = strtok_r(str, " \t;", &saveptr); entry;
+	     entry = strtok_r(NULL, " \t;", &saveptr))
+		amdgpu_pixmap_policy_parse(pScrn, policies, entry);
+
+	free(str);
+
+	/* Other processes, GPUs and the display engine need a BO, and some
+	 * of them don't know about our tiling or can't use GTT
+	 */
+	policies[AMDGPU_BO_USAGE_SCANOUT].texture = FALSE;
+	policies[AMDGPU_BO_USAGE_SCANOUT].domain = AMDGPU_GEM_DOMAIN_VRAM;
+	policies[AMDGPU_BO_USAGE_DRI2].texture = FALSE;
+	policies[AMDGPU_BO_USAGE_SHARED].texture = FALSE;
+	policies[AMDGPU_BO_USAGE_SHARED].tiled = FALSE;
+
+	xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Pixmap policy: \"%s\"\n",
+		   option);
+}
+
+void amdgpu_bo_placement_init(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_placement *placement = &info->placement;
+
+	memset(placement, 0, sizeof(*placement));
+	amdgpu_pixmap_policy_init(pScrn);
+
+	switch (info->ChipFamily) {
+	case CHIP_FAMILY_KAVERI:
+	case CHIP_FAMILY_KABINI:
+	case CHIP_FAMILY_CARRIZO:
+		placement->is_apu = TRUE;
+		break;
+	default:
+		break;
+	}
+
+#ifdef AMDGPU_IDS_FLAGS_FUSION
+	{
+		AMDGPUEntPtr pAMDGPUEnt = AMDGPUEntPriv(pScrn);
+		struct amdgpu_gpu_info gpu_info;
+
+		memset(&gpu_info, 0, sizeof(gpu_info));
+		if (amdgpu_query_gpu_info(pAMDGPUEnt->pDev, &gpu_info) == 0 &&
+		    (gpu_info.ids_flags & AMDGPU_IDS_FLAGS_FUSION))
+			placement->is_apu = TRUE;
+	}
+#endif
+
+	if (placement->is_apu)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			   "APU detected, preferring GTT for CPU accessed BOs\n");
+}
+
+void amdgpu_bo_placement_fini(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_placement *placement = &info->placement;
+	int i;
+
+	for (i = 0; i < AMDGPU_BO_USAGE_COUNT; i++) {
+		if (!placement->usage[i].allocs)
+			continue;
+
+		xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
+			       "%s pixmap BOs: %lu allocations, %lu CPU maps\n",
+			       amdgpu_bo_usage_names[i],
+			       placement->usage[i].allocs,
+			       placement->usage[i].cpu_maps);
+	}
+}
+
+enum amdgpu_bo_usage amdgpu_bo_placement_usage(int usage_hint)
+{
+	if (usage_hint & AMDGPU_CREATE_PIXMAP_SCANOUT)
+		return AMDGPU_BO_USAGE_SCANOUT;
+	if (usage_hint & AMDGPU_CREATE_PIXMAP_DRI2)
+		return AMDGPU_BO_USAGE_DRI2;
+
+	switch (usage_hint & ~AMDGPU_CREATE_PIXMAP_LINEAR) {
+	case CREATE_PIXMAP_USAGE_SCRATCH:
+		return AMDGPU_BO_USAGE_SCRATCH;
+	case CREATE_PIXMAP_USAGE_BACKING_PIXMAP:
+		return AMDGPU_BO_USAGE_BACKING;
+	case CREATE_PIXMAP_USAGE_GLYPH_PICTURE:
+		return AMDGPU_BO_USAGE_GLYPH;
+#ifdef CREATE_PIXMAP_USAGE_SHARED
+	case CREATE_PIXMAP_USAGE_SHARED:
+		return AMDGPU_BO_USAGE_SHARED;
+#endif
+	default:
+		return AMDGPU_BO_USAGE_DEFAULT;
+	}
+}
+
+static void amdgpu_bo_placement_update_heap(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	AMDGPUEntPtr pAMDGPUEnt = AMDGPUEntPriv(pScrn);
+	struct amdgpu_bo_placement *placement = &info->placement;
+	struct amdgpu_heap_info heap_info;
+	CARD32 now = GetTimeInMillis();
+
+	if (placement->vram_heap_size &&
+	    (CARD32)(now - placement->heap_query_time) <
+	    AMDGPU_PLACEMENT_HEAP_QUERY_INTERVAL)
+		return;
+
+	memset(&heap_info, 0, sizeof(heap_info));
+	if (amdgpu_query_heap_info(pAMDGPUEnt->pDev, AMDGPU_GEM_DOMAIN_VRAM, 0,
+				   &heap_info))
+		return;
+
+	placement->vram_heap_size = heap_info.heap_size;
+	placement->vram_heap_usage = heap_info.heap_usage;
+	placement->heap_query_time = now;
+}
+
+uint32_t amdgpu_bo_placement_domain(ScrnInfoPtr pScrn,
+				    enum amdgpu_bo_usage usage,
+				    uint32_t size)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_placement *placement = &info->placement;
+
+	placement->usage[usage].allocs++;
+
+	if (placement->policy[usage].domain)
+		return placement->policy[usage].domain;
+
+	/* Leave the last 1/8 of VRAM to scanout and the kernel rather than
+	 * have it evict BOs back and forth
+	 */
+	amdgpu_bo_placement_update_heap(pScrn);
+	if (placement->vram_heap_size &&
+	    placement->vram_heap_usage + size >
+	    placement->vram_heap_size - placement->vram_heap_size / 8)
+		return AMDGPU_GEM_DOMAIN_GTT;
+
+	/* On APUs VRAM is a carve-out of system memory, so BOs which are
+	 * mostly accessed by the CPU are better off in cacheable GTT
+	 */
+	if (placement->is_apu && placement->usage[usage].allocs >= 16 &&
+	    placement->usage[usage].cpu_maps * 2 > placement->usage[usage].allocs)
+		return AMDGPU_GEM_DOMAIN_GTT;
+
+	return AMDGPU_GEM_DOMAIN_VRAM;
+}
+
+void amdgpu_bo_placement_cpu_map(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+
+	info->placement.usage[bo->usage].cpu_maps++;
+}
+
+Bool amdgpu_bo_placement_migrate(ScrnInfoPtr pScrn, struct amdgpu_buffer *bo,
+				 uint32_t domain)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct drm_amdgpu_gem_op args;
+
+	if (bo->domain == domain)
+		return TRUE;
+
+	/* The kernel refuses to put BOs shared via dma-buf into VRAM, and
+	 * the placement of other BOs isn't ours to change. GBM BOs are
+	 * fine, GBM allocates them on our DRM file descriptor.
+	 */
+	if (!bo->domain ||
+	    (bo->flags & (AMDGPU_BO_FLAGS_DMABUF | AMDGPU_BO_FLAGS_IMPORTED |
+			  AMDGPU_BO_FLAGS_USERPTR)))
+		return FALSE;
+
+	memset(&args, 0, sizeof(args));
+	if (!amdgpu_bo_get_handle(bo, &args.handle))
+		return FALSE;
+
+	/* The caching mode is fixed at creation, write-combined GTT is no
+	 * faster to read from than VRAM. Mesa creates its BOs that way, so
+	 * don't try again for this one.
+	 */
+	if (domain == AMDGPU_GEM_DOMAIN_GTT) {
+		struct drm_amdgpu_gem_create_in create_info;
+
+		memset(&create_info, 0, sizeof(create_info));
+		args.op = AMDGPU_GEM_OP_GET_GEM_CREATE_INFO;
+		args.value = (uintptr_t)&create_info;
+		if (drmCommandWriteRead(info->dri2.drm_fd, DRM_AMDGPU_GEM_OP,
+					&args, sizeof(args)) ||
+		    (create_info.domain_flags & AMDGPU_GEM_CREATE_CPU_GTT_USWC)) {
+			bo->domain = 0;
+			return FALSE;
+		}
+	}
+
+	args.op = AMDGPU_GEM_OP_SET_PLACEMENT;
+	args.value = domain;
+	if (drmCommandWriteRead(info->dri2.drm_fd, DRM_AMDGPU_GEM_OP,
+				&args, sizeof(args)))
+		return FALSE;
+
+	bo->domain = domain;
+	return TRUE;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef AMDGPU_BO_PLACEMENT_H
+#define AMDGPU_BO_PLACEMENT_H 1
+
+#include <stdint.h>
+#include "xf86str.h"
+
+/* Re-query VRAM heap usage at most this often */
+#define AMDGPU_PLACEMENT_HEAP_QUERY_INTERVAL	100	/* ms */
+
+struct amdgpu_buffer;
+
+enum amdgpu_bo_usage {
+	AMDGPU_BO_USAGE_DEFAULT,
+	AMDGPU_BO_USAGE_SCRATCH,
+	AMDGPU_BO_USAGE_BACKING,
+	AMDGPU_BO_USAGE_GLYPH,
+	AMDGPU_BO_USAGE_SCANOUT,
+	AMDGPU_BO_USAGE_DRI2,
+	AMDGPU_BO_USAGE_SHARED,
+	AMDGPU_BO_USAGE_COUNT
+};
+
+/* How pixmaps of a usage class are allocated, can be overridden with
+ * Option "PixmapPolicy"
+ */
+struct amdgpu_pixmap_policy {
+	Bool texture;		/* glamor texture without a BO */
+	Bool tiled;		/* BO may be tiled */
+	uint32_t domain;	/* 0 to decide based on VRAM usage */
+	Bool cpu_access;	/* CPU maps the BO, without glamor */
+	Bool cache;		/* BO may be reused through the BO cache */
+};
+
+struct amdgpu_bo_placement {
+	Bool is_apu;
+
+	struct amdgpu_pixmap_policy policy[AMDGPU_BO_USAGE_COUNT];
+
+	/* VRAM heap usage as of heap_query_time */
+	CARD32 heap_query_time;
+	uint64_t vram_heap_size;
+	uint64_t vram_heap_usage;
+
+	/* Allocations and CPU mappings per usage */
+	struct {
+		unsigned long allocs;
+		unsigned long cpu_maps;
+	} usage[AMDGPU_BO_USAGE_COUNT];
+};
+
+/* Detect APUs, set up the pixmap policies and placement statistics */
+extern void amdgpu_bo_placement_init(ScrnInfoPtr pScrn);
+
+/* Log the placement statistics */
+extern void amdgpu_bo_placement_fini(ScrnInfoPtr pScrn);
+
+/* Map CreatePixmap usage hints to a usage class */
+extern enum amdgpu_bo_usage amdgpu_bo_placement_usage(int usage_hint);
+
+/* Policy for pixmaps of a usage class */
+#define amdgpu_bo_placement_policy(info, usage) \
+	(&(info)->placement.policy[usage])
+
+/* Pick the memory domain for a new BO
+ *
+ * \return	AMDGPU_GEM_DOMAIN_VRAM or AMDGPU_GEM_DOMAIN_GTT
+ */
+extern uint32_t amdgpu_bo_placement_domain(ScrnInfoPtr pScrn,
+					   enum amdgpu_bo_usage usage,
+					   uint32_t size);
+
+/* Account a CPU mapping of the BO to its usage class */
+extern void amdgpu_bo_placement_cpu_map(ScrnInfoPtr pScrn,
+					struct amdgpu_buffer *bo);
+
+/* Change the preferred domain of a BO, the kernel moves it there the next
+ * time the GPU uses it
+ *
+ * \return	TRUE if the BO prefers \p domain now
+ */
+extern Bool amdgpu_bo_placement_migrate(ScrnInfoPtr pScrn,
+					struct amdgpu_buffer *bo,
+					uint32_t domain);
+
+/* Whether the BO was moved away from the domain it was allocated in */
+#define amdgpu_bo_placement_migrated(bo) \
+	((bo)->domain && (bo)->domain != (bo)->cache_key.domain)
+
+#endif /* AMDGPU_BO_PLACEMENT_H */
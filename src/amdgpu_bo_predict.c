@@ -0,0 +1,308 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <xf86.h>
+#include "amdgpu_drv.h"
+#include "amdgpu_bo_helper.h"
+#include "amdgpu_bo_predict.h"
+#include "amdgpu_pixmap.h"
+
+static Bool amdgpu_bo_predict_req_equal(const struct amdgpu_bo_predict_req *a,
+					const struct amdgpu_bo_predict_req *b)
+{
+	return a->width == b->width && a->height == b->height &&
+		a->depth == b->depth && a->usage_hint == b->usage_hint &&
+		a->bpp == b->bpp;
+}
+
+/* Size of the BO amdgpu_alloc_pixmap_bo will allocate for a request, close
+ * enough to decide whether it fits in the budget before allocating it
+ */
+static uint64_t amdgpu_bo_predict_size(ScrnInfoPtr pScrn,
+				       const struct amdgpu_bo_predict_req *req)
+{
+	unsigned cpp = (req->bpp + 7) / 8;
+	unsigned pitch = cpp *
+		AMDGPU_ALIGN(req->width, drmmode_get_pitch_align(pScrn, cpp));
+
+	return (uint64_t)pitch *
+		AMDGPU_ALIGN(req->height, AMDGPU_MICRO_TILE_HEIGHT);
+}
+
+static void amdgpu_bo_predict_record(struct amdgpu_bo_predict *predict,
+				     const struct amdgpu_bo_predict_req *req)
+{
+	CARD32 now = GetTimeInMillis();
+	int i, victim = 0;
+
+	for (i = 0; i < AMDGPU_BO_PREDICT_HISTORY; i++) {
+		if (predict->history[i].hits &&
+		    amdgpu_bo_predict_req_equal(&predict->history[i].req, req)) {
+			predict->history[i].hits++;
+			predict->history[i].time = now;
+			return;
+		}
+
+		/* Replace an unused entry, or else the least recently used */
+		if (!predict->history[victim].hits)
+			continue;
+		if (!predict->history[i].hits ||
+		    (CARD32)(now - predict->history[i].time) >
+		    (CARD32)(now - predict->history[victim].time))
+			victim = i;
+	}
+
+	predict->history[victim].req = *req;
+	predict->history[victim].hits = 1;
+	predict->history[victim].time = now;
+}
+
+/* Sizes to keep a BO around for, most likely first: full screen windows on
+ * each CRTC, then sizes which were requested repeatedly
+ */
+static int amdgpu_bo_predict_candidates(ScrnInfoPtr pScrn,
+					struct amdgpu_bo_predict_req *cand)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_predict *predict = &info->bo_predict;
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	CARD32 now = GetTimeInMillis();
+	int num = 0;
+	int i, j;
+
+	for (i = 0; i < config->num_crtc && num < AMDGPU_BO_PREDICT_STOCK; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct amdgpu_bo_predict_req req;
+
+		if (!crtc->enabled)
+			continue;
+
+		if (crtc->rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+			req.width = crtc->mode.VDisplay;
+			req.height = crtc->mode.HDisplay;
+		} else {
+			req.width = crtc->mode.HDisplay;
+			req.height = crtc->mode.VDisplay;
+		}
+		req.depth = pScrn->depth;
+		req.usage_hint = AMDGPU_CREATE_PIXMAP_DRI2;
+		if (!info->use_glamor)
+			req.usage_hint |= AMDGPU_CREATE_PIXMAP_LINEAR;
+		req.bpp = pScrn->bitsPerPixel;
+
+		for (j = 0; j < num; j++)
+			if (amdgpu_bo_predict_req_equal(&cand[j], &req))
+				break;
+		if (j == num)
+			cand[num++] = req;
+	}
+
+	for (i = 0; i < AMDGPU_BO_PREDICT_HISTORY; i++) {
+		if (predict->history[i].hits &&
+		    (CARD32)(now - predict->history[i].time) >
+		    AMDGPU_BO_PREDICT_TIMEOUT)
+			predict->history[i].hits = 0;
+	}
+
+	while (num < AMDGPU_BO_PREDICT_STOCK) {
+		int best = -1;
+
+		for (i = 0; i < AMDGPU_BO_PREDICT_HISTORY; i++) {
+			if (predict->history[i].hits < AMDGPU_BO_PREDICT_MIN_HITS)
+				continue;
+
+			for (j = 0; j < num; j++)
+				if (amdgpu_bo_predict_req_equal(&cand[j],
+								&predict->history[i].req))
+					break;
+			if (j < num)
+				continue;
+
+			if (best < 0 ||
+			    predict->history[i].hits > predict->history[best].hits)
+				best = i;
+		}
+
+		if (best < 0)
+			break;
+
+		cand[num++] = predict->history[best].req;
+	}
+
+	return num;
+}
+
+void amdgpu_bo_predict_init(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_predict *predict = &info->bo_predict;
+
+	memset(predict, 0, sizeof(*predict));
+	predict->enabled = info->dri2.enabled && info->bo_cache.max_size > 0;
+}
+
+void amdgpu_bo_predict_fini(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_predict *predict = &info->bo_predict;
+	int i;
+
+	if (!predict->enabled)
+		return;
+
+	for (i = 0; i < AMDGPU_BO_PREDICT_STOCK; i++) {
+		if (predict->stock[i].bo)
+			amdgpu_bo_unref(&predict->stock[i].bo);
+	}
+
+	xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
+		       "DRI2 buffer prediction: %lu hits, %lu misses\n",
+		       predict->hits, predict->misses);
+
+	predict->stock_size = 0;
+	predict->enabled = FALSE;
+}
+
+struct amdgpu_buffer *
+amdgpu_bo_predict_get(ScrnInfoPtr pScrn,
+		      const struct amdgpu_bo_predict_req *req, int *pitch)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_predict *predict = &info->bo_predict;
+	struct amdgpu_buffer *bo;
+	int i;
+
+	/* Allocations from amdgpu_bo_predict_refill end up here as well */
+	if (!predict->enabled || predict->refilling)
+		return NULL;
+
+	amdgpu_bo_predict_record(predict, req);
+
+	for (i = 0; i < AMDGPU_BO_PREDICT_STOCK; i++) {
+		if (!predict->stock[i].bo ||
+		    !amdgpu_bo_predict_req_equal(&predict->stock[i].req, req))
+			continue;
+
+		bo = predict->stock[i].bo;
+		predict->stock[i].bo = NULL;
+		predict->stock_size -= bo->size;
+		predict->hits++;
+
+		if (pitch)
+			*pitch = predict->stock[i].pitch;
+		return bo;
+	}
+
+	predict->misses++;
+	return NULL;
+}
+
+void amdgpu_bo_predict_refill(ScrnInfoPtr pScrn)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
+	struct amdgpu_bo_predict *predict = &info->bo_predict;
+	struct amdgpu_bo_predict_req cand[AMDGPU_BO_PREDICT_STOCK];
+	CARD32 now = GetTimeInMillis();
+	int num, i, j, slot = -1;
+
+	if (!predict->enabled ||
+	    (CARD32)(now - predict->refill_time) < AMDGPU_BO_PREDICT_INTERVAL)
+		return;
+
+	predict->refill_time = now;
+	num = amdgpu_bo_predict_candidates(pScrn, cand);
+
+	/* BOs for sizes which aren't likely anymore go to the BO cache,
+	 * where they're still available for a while
+	 */
+	for (i = 0; i < AMDGPU_BO_PREDICT_STOCK; i++) {
+		if (!predict->stock[i].bo)
+			continue;
+
+		for (j = 0; j < num; j++)
+			if (amdgpu_bo_predict_req_equal(&cand[j],
+							&predict->stock[i].req))
+				break;
+		if (j < num)
+			continue;
+
+		predict->stock_size -= predict->stock[i].bo->size;
+		amdgpu_bo_unref(&predict->stock[i].bo);
+	}
+
+	/* Pick the most likely candidate which isn't in stock yet and fits
+	 * in the budget. One which would never fit is skipped, rather than
+	 * allocated and freed again on every refill.
+	 */
+	for (j = 0; j < num; j++) {
+		for (i = 0; i < AMDGPU_BO_PREDICT_STOCK; i++) {
+			if (predict->stock[i].bo &&
+			    amdgpu_bo_predict_req_equal(&cand[j],
+							&predict->stock[i].req))
+				break;
+		}
+		if (i < AMDGPU_BO_PREDICT_STOCK)
+			continue;
+
+		if (predict->stock_size + amdgpu_bo_predict_size(pScrn, &cand[j]) <=
+		    info->bo_cache.max_size)
+			break;
+	}
+
+	if (j == num)
+		return;
+
+	for (i = 0; i < AMDGPU_BO_PREDICT_STOCK; i++) {
+		if (!predict->stock[i].bo) {
+			slot = i;
+			break;
+		}
+	}
+
+	if (slot < 0)
+		return;
+
+	predict->refilling = TRUE;
+	predict->stock[slot].bo =
+		amdgpu_alloc_pixmap_bo(pScrn, cand[j].width, cand[j].height,
+				       cand[j].depth, cand[j].usage_hint,
+				       cand[j].bpp, &predict->stock[slot].pitch);
+	predict->refilling = FALSE;
+
+	if (!predict->stock[slot].bo)
+		return;
+
+	if (predict->stock_size + predict->stock[slot].bo->size >
+	    info->bo_cache.max_size) {
+		amdgpu_bo_unref(&predict->stock[slot].bo);
+		return;
+	}
+
+	predict->stock[slot].req = cand[j];
+	predict->stock_size += predict->stock[slot].bo->size;
+}
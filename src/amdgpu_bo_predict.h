@@ -0,0 +1,100 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef AMDGPU_BO_PREDICT_H
+#define AMDGPU_BO_PREDICT_H 1
+
+#include <stdint.h>
+#include "xf86str.h"
+
+/* Recently requested DRI2 buffer sizes remembered */
+#define AMDGPU_BO_PREDICT_HISTORY	8
+
+/* A size has to be requested this often to be allocated ahead of time */
+#define AMDGPU_BO_PREDICT_MIN_HITS	2
+
+/* Sizes which haven't been requested for this long are forgotten */
+#define AMDGPU_BO_PREDICT_TIMEOUT	10000	/* ms */
+
+/* BOs allocated ahead of time, at most one per size */
+#define AMDGPU_BO_PREDICT_STOCK		4
+
+/* Allocate at most one BO ahead of time per interval */
+#define AMDGPU_BO_PREDICT_INTERVAL	100	/* ms */
+
+struct amdgpu_buffer;
+
+/* Parameters of an amdgpu_alloc_pixmap_bo call */
+struct amdgpu_bo_predict_req {
+	int width;
+	int height;
+	int depth;
+	int usage_hint;
+	int bpp;
+};
+
+struct amdgpu_bo_predict {
+	Bool enabled;
+	Bool refilling;
+	CARD32 refill_time;
+	uint64_t stock_size;
+	unsigned long hits;
+	unsigned long misses;
+
+	struct {
+		struct amdgpu_bo_predict_req req;
+		unsigned hits;
+		CARD32 time;
+	} history[AMDGPU_BO_PREDICT_HISTORY];
+
+	struct {
+		struct amdgpu_bo_predict_req req;
+		struct amdgpu_buffer *bo;
+		int pitch;
+	} stock[AMDGPU_BO_PREDICT_STOCK];
+};
+
+/* Set up the per-screen DRI2 buffer predictor. It's disabled along with the
+ * BO cache, whose size also bounds the memory allocated ahead of time.
+ */
+extern void amdgpu_bo_predict_init(ScrnInfoPtr pScrn);
+
+/* Free BOs allocated ahead of time and disable the predictor */
+extern void amdgpu_bo_predict_fini(ScrnInfoPtr pScrn);
+
+/* Record a DRI2 buffer request and hand out a BO allocated ahead of time
+ * for it if there is one
+ *
+ * \return	BO with a single reference, pitch stored in *pitch
+ *		NULL if nothing was allocated for this request
+ */
+extern struct amdgpu_buffer *
+amdgpu_bo_predict_get(ScrnInfoPtr pScrn,
+		      const struct amdgpu_bo_predict_req *req, int *pitch);
+
+/* Allocate a BO for the most likely next request which doesn't have one
+ * yet, called from the BlockHandler
+ */
+extern void amdgpu_bo_predict_refill(ScrnInfoPtr pScrn);
+
+#endif /* AMDGPU_BO_PREDICT_H */
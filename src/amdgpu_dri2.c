@@ -41,6 +41,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 
 #include <gbm.h>
 
@@ -75,8 +76,47 @@ struct dri2_buffer_priv {
 	PixmapPtr pixmap;
 	unsigned int attachment;
 	unsigned int refcnt;
+
+	/* Drawable the buffer was created for, and its size back then */
+	XID drawable;
+	unsigned int width;
+	unsigned int height;
+	BufferPtr buffer;
+	struct xorg_list cache_link;
 };
 
+/* Regions with more boxes are copied as a whole, by their extents */
+#define AMDGPU_DRI2_COPY_MAX_BOXES	16
+
+/* Per drawable state which outlives its DRI2 buffers, freed along with the
+ * drawable
+ */
+struct amdgpu_dri2_drawable {
+	ScreenPtr screen;
+
+	/* Released buffers, for when the client asks for the same attachment
+	 * again after an invalidate. Most recently released first.
+	 */
+	struct xorg_list buffers;
+	unsigned int count;
+
+	/* Fences of the last full window swaps to the front buffer */
+	int throttle_fence[AMDGPU_DRI2_THROTTLE_MAX];
+	unsigned int throttle_head;
+
+	/* Copies between buffers, pixels in the requested regions and pixels
+	 * actually copied
+	 */
+	unsigned long copies;
+	uint64_t copy_requested;
+	uint64_t copy_pixels;
+};
+
+#define AMDGPU_DRI2_BUFFER_CACHE_MAX	4
+
+static RESTYPE amdgpu_dri2_drawable_type;
+static unsigned long amdgpu_dri2_drawable_generation;
+
 static PixmapPtr get_drawable_pixmap(DrawablePtr drawable)
 {
 	if (drawable->type == DRAWABLE_PIXMAP)
@@ -91,6 +131,7 @@ static PixmapPtr fixup_glamor(DrawablePtr drawable, PixmapPtr pixmap)
 	PixmapPtr old = get_drawable_pixmap(drawable);
 	ScreenPtr screen = drawable->pScreen;
 	struct amdgpu_pixmap *priv = amdgpu_get_pixmap_private(pixmap);
+	struct amdgpu_pixmap *old_priv = amdgpu_get_pixmap_private(old);
 	GCPtr gc;
 
 	/* With a glamor pixmap, 2D pixmaps are created in texture
@@ -116,22 +157,195 @@ static PixmapPtr fixup_glamor(DrawablePtr drawable, PixmapPtr pixmap)
 		FreeScratchGC(gc);
 	}
 
-	amdgpu_set_pixmap_private(pixmap, NULL);
+	/* Move the BO reference over to the old pixmap */
+	*old_priv = *priv;
+	memset(priv, 0, sizeof(*priv));
 
 	/* And redirect the pixmap to the new bo (for 3D). */
 	glamor_egl_exchange_buffers(old, pixmap);
-	amdgpu_set_pixmap_private(old, priv);
 	screen->DestroyPixmap(pixmap);
 	old->refcnt++;
 
 	screen->ModifyPixmapHeader(old,
 				   old->drawable.width,
 				   old->drawable.height,
-				   0, 0, priv->stride, NULL);
+				   0, 0, old_priv->stride, NULL);
 
 	return old;
 }
 
+static void amdgpu_dri2_buffer_free(ScreenPtr pScreen, BufferPtr buffers)
+{
+	struct dri2_buffer_priv *private = buffers->driverPrivate;
+
+	if (private->pixmap)
+		(*pScreen->DestroyPixmap) (private->pixmap);
+
+	free(private);
+	free(buffers);
+}
+
+static int amdgpu_dri2_drawable_gone(pointer data, XID id)
+{
+	struct amdgpu_dri2_drawable *priv = data;
+	struct dri2_buffer_priv *private, *tmp;
+	int i;
+
+	if (priv->copies)
+		xf86DrvMsgVerb(xf86ScreenToScrn(priv->screen)->scrnIndex, X_INFO,
+			       AMDGPU_LOGLEVEL_DEBUG,
+			       "DRI2 drawable 0x%x: %lu copies, %llu of %llu "
+			       "requested pixels copied\n",
+			       (unsigned int)id, priv->copies,
+			       (unsigned long long)priv->copy_pixels,
+			       (unsigned long long)priv->copy_requested);
+
+	xorg_list_for_each_entry_safe(private, tmp, &priv->buffers,
+				      cache_link) {
+		xorg_list_del(&private->cache_link);
+		amdgpu_dri2_buffer_free(priv->screen, private->buffer);
+	}
+
+	for (i = 0; i < AMDGPU_DRI2_THROTTLE_MAX; i++) {
+		if (priv->throttle_fence[i] >= 0)
+			close(priv->throttle_fence[i]);
+	}
+
+	free(priv);
+	return Success;
+}
+
+static struct amdgpu_dri2_drawable *amdgpu_dri2_drawable_lookup(XID id)
+{
+	pointer priv;
+
+	if (!amdgpu_dri2_drawable_type ||
+	    dixLookupResourceByType(&priv, id, amdgpu_dri2_drawable_type,
+				    NullClient, DixReadAccess) != Success)
+		return NULL;
+
+	return priv;
+}
+
+/* Look up the state of a drawable, creating it if there's none yet */
+static struct amdgpu_dri2_drawable *
+amdgpu_dri2_drawable_get(ScreenPtr pScreen, XID id)
+{
+	struct amdgpu_dri2_drawable *priv = amdgpu_dri2_drawable_lookup(id);
+	int i;
+
+	if (priv || !amdgpu_dri2_drawable_type)
+		return priv;
+
+	priv = calloc(1, sizeof(*priv));
+	if (!priv)
+		return NULL;
+
+	priv->screen = pScreen;
+	xorg_list_init(&priv->buffers);
+	for (i = 0; i < AMDGPU_DRI2_THROTTLE_MAX; i++)
+		priv->throttle_fence[i] = -1;
+
+	/* Frees priv on failure */
+	if (!AddResource(id, amdgpu_dri2_drawable_type, priv))
+		return NULL;
+
+	return priv;
+}
+
+/* Free the cached buffers of another size than the drawable's current one */
+static void
+amdgpu_dri2_buffer_cache_trim(struct amdgpu_dri2_drawable *priv,
+			      DrawablePtr drawable)
+{
+	struct dri2_buffer_priv *private, *tmp;
+
+	xorg_list_for_each_entry_safe(private, tmp, &priv->buffers,
+				      cache_link) {
+		if (private->width == drawable->width &&
+		    private->height == drawable->height)
+			continue;
+
+		xorg_list_del(&private->cache_link);
+		priv->count--;
+		amdgpu_dri2_buffer_free(priv->screen, private->buffer);
+	}
+}
+
+static BufferPtr
+amdgpu_dri2_buffer_cache_get(DrawablePtr drawable, unsigned int attachment,
+			     unsigned int format)
+{
+	struct amdgpu_dri2_drawable *priv;
+	struct dri2_buffer_priv *private;
+
+	/* Set up the state here, buffers are only cached once it exists */
+	priv = amdgpu_dri2_drawable_get(drawable->pScreen, drawable->id);
+	if (!priv)
+		return NULL;
+
+	amdgpu_dri2_buffer_cache_trim(priv, drawable);
+
+	xorg_list_for_each_entry(private, &priv->buffers, cache_link) {
+		if (private->attachment == attachment &&
+		    private->buffer->format == format) {
+			xorg_list_del(&private->cache_link);
+			priv->count--;
+			private->refcnt = 1;
+			return private->buffer;
+		}
+	}
+
+	return NULL;
+}
+
+/* Keep a buffer whose last reference was dropped around for its drawable.
+ * After a resize, this is when the buffers of the old size are released,
+ * so they're dropped here rather than on the next lookup.
+ *
+ * \return	TRUE if the cache took over the buffer
+ */
+static Bool
+amdgpu_dri2_buffer_cache_put(ScreenPtr pScreen, DrawablePtr drawable,
+			     BufferPtr buffers)
+{
+	struct dri2_buffer_priv *private = buffers->driverPrivate;
+	struct amdgpu_dri2_drawable *priv;
+
+	/* Front buffers reference the drawable's own pixmap */
+	if (private->attachment == DRI2BufferFrontLeft || !private->pixmap ||
+	    !drawable || private->drawable != drawable->id)
+		return FALSE;
+
+	priv = amdgpu_dri2_drawable_lookup(private->drawable);
+	if (priv)
+		amdgpu_dri2_buffer_cache_trim(priv, drawable);
+
+	if (private->width != drawable->width ||
+	    private->height != drawable->height)
+		return FALSE;
+
+	/* This may run while the drawable's resources are freed, so don't
+	 * create its state here
+	 */
+	if (!priv)
+		return FALSE;
+
+	if (priv->count == AMDGPU_DRI2_BUFFER_CACHE_MAX) {
+		struct dri2_buffer_priv *oldest =
+			xorg_list_entry(priv->buffers.prev,
+					struct dri2_buffer_priv, cache_link);
+
+		xorg_list_del(&oldest->cache_link);
+		priv->count--;
+		amdgpu_dri2_buffer_free(pScreen, oldest->buffer);
+	}
+
+	xorg_list_add(&private->cache_link, &priv->buffers);
+	priv->count++;
+	return TRUE;
+}
+
 static BufferPtr
 amdgpu_dri2_create_buffer2(ScreenPtr pScreen,
 			   DrawablePtr drawable,
@@ -147,9 +361,17 @@ amdgpu_dri2_create_buffer2(ScreenPtr pScreen,
 	unsigned aligned_width = drawable->width;
 	unsigned height = drawable->height;
 	Bool is_glamor_pixmap = FALSE;
+	unsigned usage = AMDGPU_CREATE_PIXMAP_DRI2;
 	int depth;
 	int cpp;
 
+	if (attachment != DRI2BufferFrontLeft) {
+		buffers = amdgpu_dri2_buffer_cache_get(drawable, attachment,
+						       format);
+		if (buffers)
+			return buffers;
+	}
+
 	if (format) {
 		depth = format;
 
@@ -177,7 +399,9 @@ amdgpu_dri2_create_buffer2(ScreenPtr pScreen,
 		pixmap = get_drawable_pixmap(drawable);
 		if (pScreen != pixmap->drawable.pScreen)
 			pixmap = NULL;
-		else if (info->use_glamor && !amdgpu_get_pixmap_bo(pixmap)) {
+		else if (info->use_glamor && !amdgpu_get_pixmap_bo(pixmap) &&
+			 !amdgpu_glamor_export_pixmap(pixmap)) {
+			/* Fall back to copying into a new BO */
 			is_glamor_pixmap = TRUE;
 			aligned_width = pixmap->drawable.width;
 			height = pixmap->drawable.height;
@@ -193,11 +417,17 @@ amdgpu_dri2_create_buffer2(ScreenPtr pScreen,
 		if (aligned_width == front_width)
 			aligned_width = pScrn->virtualX;
 
+		/* Only the client ever accesses these */
+		if (attachment == DRI2BufferDepth ||
+		    attachment == DRI2BufferStencil ||
+		    attachment == DRI2BufferDepthStencil)
+			usage |= AMDGPU_CREATE_PIXMAP_DEPTH;
+
 		pixmap = (*pScreen->CreatePixmap) (pScreen,
 						   aligned_width,
 						   height,
 						   depth,
-						   AMDGPU_CREATE_PIXMAP_DRI2);
+						   usage);
 	}
 
 	buffers = calloc(1, sizeof *buffers);
@@ -209,9 +439,6 @@ amdgpu_dri2_create_buffer2(ScreenPtr pScreen,
 	}
 
 	if (pixmap) {
-		struct drm_gem_flink flink;
-		union gbm_bo_handle bo_handle;
-
 		if (is_glamor_pixmap)
 			pixmap = fixup_glamor(drawable, pixmap);
 		bo = amdgpu_get_pixmap_bo(pixmap);
@@ -219,17 +446,8 @@ amdgpu_dri2_create_buffer2(ScreenPtr pScreen,
 			goto error;
 		}
 
-		if (bo->flags & AMDGPU_BO_FLAGS_GBM) {
-			bo_handle = gbm_bo_get_handle(bo->bo.gbm);
-			flink.handle = bo_handle.u32;
-			if (ioctl(info->dri2.drm_fd, DRM_IOCTL_GEM_FLINK, &flink) < 0)
-				goto error;
-			buffers->name = flink.name;
-		} else {
-			amdgpu_bo_export(bo->bo.amdgpu,
-				amdgpu_bo_handle_type_gem_flink_name,
-				&buffers->name);
-		}
+		if (!amdgpu_bo_get_flink_name(pScrn, bo, &buffers->name))
+			goto error;
 	}
 
 	privates = calloc(1, sizeof(struct dri2_buffer_priv));
@@ -247,6 +465,10 @@ amdgpu_dri2_create_buffer2(ScreenPtr pScreen,
 	privates->pixmap = pixmap;
 	privates->attachment = attachment;
 	privates->refcnt = 1;
+	privates->drawable = drawable->id;
+	privates->width = drawable->width;
+	privates->height = drawable->height;
+	privates->buffer = buffers;
 
 	return buffers;
 
@@ -283,13 +505,9 @@ amdgpu_dri2_destroy_buffer2(ScreenPtr pScreen,
 		}
 
 		private->refcnt--;
-		if (private->refcnt == 0) {
-			if (private->pixmap)
-				(*pScreen->DestroyPixmap) (private->pixmap);
-
-			free(buffers->driverPrivate);
-			free(buffers);
-		}
+		if (private->refcnt == 0 &&
+		    !amdgpu_dri2_buffer_cache_put(pScreen, drawable, buffers))
+			amdgpu_dri2_buffer_free(pScreen, buffers);
 	}
 }
 
@@ -308,6 +526,64 @@ static inline PixmapPtr GetDrawablePixmap(DrawablePtr drawable)
 	}
 }
 
+/* Wait for the full window swap SwapThrottle swaps ago to finish, or for
+ * all previous ones without sync_file support
+ */
+static void amdgpu_dri2_throttle_wait(ScrnInfoPtr scrn,
+				      struct amdgpu_dri2_drawable *priv,
+				      struct amdgpu_buffer *bo)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	int *fence = &priv->throttle_fence[priv->throttle_head];
+	struct pollfd p = { .fd = *fence, .events = POLLIN };
+
+	if (*fence < 0) {
+		if (!info->dri2.sync_file)
+			amdgpu_bo_wait_idle(scrn, bo);
+		return;
+	}
+
+	while (poll(&p, 1, -1) < 0 && (errno == EINTR || errno == EAGAIN))
+		;
+
+	close(*fence);
+	*fence = -1;
+}
+
+/* Remember the fence of the full window swap just submitted */
+static void amdgpu_dri2_throttle_fence(ScrnInfoPtr scrn,
+				       struct amdgpu_dri2_drawable *priv,
+				       struct amdgpu_buffer *bo)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	int fence;
+
+	if (!info->dri2.sync_file)
+		return;
+
+	/* The fence only covers rendering the kernel knows about */
+	amdgpu_glamor_flush(scrn);
+
+	fence = amdgpu_bo_export_sync_file(scrn, bo);
+	if (fence < 0) {
+		if (errno == ENOTTY) {
+			xf86DrvMsg(scrn->scrnIndex, X_INFO,
+				   "Kernel can't export sync_files, throttling "
+				   "swaps by waiting for idle\n");
+			info->dri2.sync_file = FALSE;
+			return;
+		}
+
+		/* Throttle this swap without a fence */
+		amdgpu_bo_wait_idle(scrn, bo);
+		return;
+	}
+
+	priv->throttle_fence[priv->throttle_head] = fence;
+	priv->throttle_head = (priv->throttle_head + 1) %
+		info->dri2.swap_throttle;
+}
+
 static void
 amdgpu_dri2_copy_region2(ScreenPtr pScreen,
 			 DrawablePtr drawable,
@@ -316,12 +592,22 @@ amdgpu_dri2_copy_region2(ScreenPtr pScreen,
 {
 	struct dri2_buffer_priv *src_private = src_buffer->driverPrivate;
 	struct dri2_buffer_priv *dst_private = dest_buffer->driverPrivate;
+	ScrnInfoPtr scrn = xf86ScreenToScrn(pScreen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
 	DrawablePtr src_drawable;
 	DrawablePtr dst_drawable;
+	PixmapPtr src_pixmap, dst_pixmap;
+	struct amdgpu_dri2_drawable *priv;
+	struct amdgpu_buffer *throttle_bo = NULL;
 	RegionPtr copy_clip;
+	BoxRec bounds, extents, boxes[AMDGPU_DRI2_COPY_MAX_BOXES];
+	BoxPtr box;
+	uint64_t area = 0;
 	GCPtr gc;
 	Bool translate = FALSE;
 	int off_x = 0, off_y = 0;
+	int nbox = 0;
+	int i;
 
 	src_drawable = &src_private->pixmap->drawable;
 	dst_drawable = &dst_private->pixmap->drawable;
@@ -348,6 +634,18 @@ amdgpu_dri2_copy_region2(ScreenPtr pScreen,
 		off_x = drawable->x - pPix->screen_x;
 		off_y = drawable->y - pPix->screen_y;
 	}
+
+	src_pixmap = get_drawable_pixmap(src_drawable);
+	dst_pixmap = get_drawable_pixmap(dst_drawable);
+	if (!amdgpu_pixmap_prepare_access(src_pixmap, FALSE,
+					  REGION_EXTENTS(pScreen, region)))
+		return;
+	if (!amdgpu_pixmap_prepare_access(dst_pixmap, TRUE,
+					  REGION_EXTENTS(pScreen, region))) {
+		amdgpu_pixmap_finish_access(src_pixmap);
+		return;
+	}
+
 	gc = GetScratchGC(dst_drawable->depth, pScreen);
 	copy_clip = REGION_CREATE(pScreen, NULL, 0);
 	REGION_COPY(pScreen, copy_clip, region);
@@ -359,30 +657,94 @@ amdgpu_dri2_copy_region2(ScreenPtr pScreen,
 	(*gc->funcs->ChangeClip) (gc, CT_REGION, copy_clip, 0);
 	ValidateGC(dst_drawable, gc);
 
+	priv = amdgpu_dri2_drawable_get(pScreen, drawable->id);
+
 	/* If this is a full buffer swap or frontbuffer flush, throttle on the
-	 * previous one
+	 * previous ones. fb copies finish before returning anyway.
 	 */
-	if (dst_private->attachment == DRI2BufferFrontLeft) {
-		if (REGION_NUM_RECTS(region) == 1) {
-			BoxPtr extents = REGION_EXTENTS(pScreen, region);
+	if (priv && dst_private->attachment == DRI2BufferFrontLeft &&
+	    info->use_glamor && info->dri2.swap_throttle > 0 &&
+	    REGION_NUM_RECTS(region) == 1) {
+		BoxPtr extents = REGION_EXTENTS(pScreen, region);
+
+		if (extents->x1 == 0 && extents->y1 == 0 &&
+		    extents->x2 == drawable->width &&
+		    extents->y2 == drawable->height)
+			throttle_bo = amdgpu_get_pixmap_bo(dst_pixmap);
+	}
 
-			if (extents->x1 == 0 && extents->y1 == 0 &&
-			    extents->x2 == drawable->width &&
-			    extents->y2 == drawable->height) {
-				char pixel[4];
+	/* Only copy the boxes of the region within the drawable. Regions with
+	 * many boxes, or whose boxes cover most of their extents, are copied
+	 * in one go, clipped by the GC.
+	 */
+	bounds.x1 = bounds.y1 = 0;
+	bounds.x2 = drawable->width;
+	bounds.y2 = drawable->height;
+	extents.x1 = extents.y1 = MAXSHORT;
+	extents.x2 = extents.y2 = MINSHORT;
+
+	box = REGION_RECTS(region);
+	for (i = 0; i < REGION_NUM_RECTS(region); i++, box++) {
+		BoxRec b;
+
+		b.x1 = max(box->x1, bounds.x1);
+		b.y1 = max(box->y1, bounds.y1);
+		b.x2 = min(box->x2, bounds.x2);
+		b.y2 = min(box->y2, bounds.y2);
+		if (b.x1 >= b.x2 || b.y1 >= b.y2)
+			continue;
+
+		area += (uint64_t)(b.x2 - b.x1) * (b.y2 - b.y1);
+		extents.x1 = min(extents.x1, b.x1);
+		extents.y1 = min(extents.y1, b.y1);
+		extents.x2 = max(extents.x2, b.x2);
+		extents.y2 = max(extents.y2, b.y2);
+
+		if (nbox < AMDGPU_DRI2_COPY_MAX_BOXES)
+			boxes[nbox] = b;
+		nbox++;
+	}
 
-				/* XXX: This is a pretty big hammer... */
-				pScreen->GetImage(drawable, 0, 0, 1, 1,
-						  ZPixmap, ~0, pixel);
-			}
+	if (nbox > 1 &&
+	    (nbox > AMDGPU_DRI2_COPY_MAX_BOXES ||
+	     area * 4 >= (uint64_t)(extents.x2 - extents.x1) *
+	     (extents.y2 - extents.y1) * 3)) {
+		boxes[0] = extents;
+		nbox = 1;
+	}
+
+	if (priv) {
+		priv->copies++;
+		box = REGION_RECTS(region);
+		for (i = 0; i < REGION_NUM_RECTS(region); i++, box++) {
+			priv->copy_requested +=
+				(uint64_t)(box->x2 - box->x1) *
+				(box->y2 - box->y1);
+		}
+		for (i = 0; i < nbox; i++) {
+			priv->copy_pixels +=
+				(uint64_t)(boxes[i].x2 - boxes[i].x1) *
+				(boxes[i].y2 - boxes[i].y1);
 		}
 	}
 
-	(*gc->ops->CopyArea) (src_drawable, dst_drawable, gc,
-			      0, 0, drawable->width, drawable->height, off_x,
-			      off_y);
+	if (throttle_bo)
+		amdgpu_dri2_throttle_wait(scrn, priv, throttle_bo);
+
+	for (i = 0; i < nbox; i++)
+		(*gc->ops->CopyArea) (src_drawable, dst_drawable, gc,
+				      boxes[i].x1, boxes[i].y1,
+				      boxes[i].x2 - boxes[i].x1,
+				      boxes[i].y2 - boxes[i].y1,
+				      boxes[i].x1 + off_x, boxes[i].y1 + off_y);
+
+	if (throttle_bo)
+		amdgpu_dri2_throttle_fence(scrn, priv, throttle_bo);
 
 	FreeScratchGC(gc);
+
+	amdgpu_pixmap_finish_access(dst_pixmap);
+	amdgpu_pixmap_finish_access(src_pixmap);
 }
 
 void
@@ -564,35 +926,28 @@ amdgpu_dri2_schedule_flip(ScrnInfoPtr scrn, ClientPtr client,
 	back_priv = back->driverPrivate;
 	bo = amdgpu_get_pixmap_bo(back_priv->pixmap);
 
-	return amdgpu_do_pageflip(scrn, bo, flip_info, ref_crtc_hw_id);
+	if (amdgpu_do_pageflip(scrn, bo, flip_info, ref_crtc_hw_id,
+			       amdgpu_dri2_flip_event_handler, FALSE))
+		return TRUE;
+
+	free(flip_info);
+	return FALSE;
 }
 
 static Bool update_front(DrawablePtr draw, DRI2BufferPtr front)
 {
 	ScreenPtr screen = draw->pScreen;
 	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
-	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
 	PixmapPtr pixmap;
 	struct dri2_buffer_priv *priv = front->driverPrivate;
 	struct amdgpu_buffer *bo = NULL;
-	union gbm_bo_handle bo_handle;
-	struct drm_gem_flink flink;
 
 	pixmap = get_drawable_pixmap(draw);
-	pixmap->refcnt++;
-
 	bo = amdgpu_get_pixmap_bo(pixmap);
-	if (bo->flags & AMDGPU_BO_FLAGS_GBM) {
-		bo_handle = gbm_bo_get_handle(bo->bo.gbm);
-		flink.handle = bo_handle.u32;
-		if (ioctl(info->dri2.drm_fd, DRM_IOCTL_GEM_FLINK, &flink) < 0)
-			return FALSE;
-		front->name = flink.name;
-	} else {
-		amdgpu_bo_export(bo->bo.amdgpu,
-			amdgpu_bo_handle_type_gem_flink_name,
-			&front->name);
-	}
+	if (!amdgpu_bo_get_flink_name(scrn, bo, &front->name))
+		return FALSE;
+
+	pixmap->refcnt++;
 	(*draw->pScreen->DestroyPixmap) (priv->pixmap);
 	front->pitch = pixmap->devKind;
 	front->cpp = pixmap->drawable.bitsPerPixel / 8;
@@ -636,6 +991,11 @@ can_exchange(ScrnInfoPtr pScrn, DrawablePtr draw,
 	if (front_pixmap->devKind != back_pixmap->devKind)
 		return FALSE;
 
+	/* Back buffers which ended up in GTT may be tiled differently */
+	if (!amdgpu_bo_same_tiling(pScrn, amdgpu_get_pixmap_bo(front_pixmap),
+				   amdgpu_get_pixmap_bo(back_pixmap)))
+		return FALSE;
+
 	return TRUE;
 }
 
@@ -687,6 +1047,7 @@ amdgpu_dri2_exchange_buffers(DrawablePtr draw, DRI2BufferPtr front,
 		amdgpu_bo_unref(&info->front_buffer);
 		info->front_buffer = back_bo;
 		amdgpu_set_pixmap_bo(screen->GetScreenPixmap(screen), back_bo);
+		amdgpu_readback_invalidate(xf86ScreenToScrn(screen));
 	}
 
 	amdgpu_glamor_exchange_buffers(front_priv->pixmap, back_priv->pixmap);
@@ -694,6 +1055,21 @@ amdgpu_dri2_exchange_buffers(DrawablePtr draw, DRI2BufferPtr front,
 	DamageRegionProcessPending(&front_priv->pixmap->drawable);
 }
 
+/* Drop an event which won't be handled, also when the screen is closed with
+ * the event still queued
+ */
+static void amdgpu_dri2_frame_event_abort(void *event_data)
+{
+	DRI2FrameEventPtr event = event_data;
+
+	if (event->valid) {
+		amdgpu_dri2_unref_buffer(event->front);
+		amdgpu_dri2_unref_buffer(event->back);
+		ListDelDRI2ClientEvents(event->client, &event->link);
+	}
+	free(event);
+}
+
 void amdgpu_dri2_frame_event_handler(unsigned int frame, unsigned int tv_sec,
 				     unsigned int tv_usec, void *event_data)
 {
@@ -770,12 +1146,7 @@ void amdgpu_dri2_frame_event_handler(unsigned int frame, unsigned int tv_sec,
 	}
 
 cleanup:
-	if (event->valid) {
-		amdgpu_dri2_unref_buffer(event->front);
-		amdgpu_dri2_unref_buffer(event->back);
-		ListDelDRI2ClientEvents(event->client, &event->link);
-	}
-	free(event);
+	amdgpu_dri2_frame_event_abort(event);
 }
 
 drmVBlankSeqType amdgpu_populate_vbl_request_type(xf86CrtcPtr crtc)
@@ -882,11 +1253,6 @@ CARD32 amdgpu_dri2_extrapolate_msc_delay(xf86CrtcPtr crtc, CARD64 * target_msc,
  */
 static int amdgpu_dri2_get_msc(DrawablePtr draw, CARD64 * ust, CARD64 * msc)
 {
-	ScreenPtr screen = draw->pScreen;
-	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
-	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
-	drmVBlank vbl;
-	int ret;
 	xf86CrtcPtr crtc = amdgpu_dri2_drawable_crtc(draw, TRUE);
 
 	/* Drawable not displayed, make up a value */
@@ -895,52 +1261,8 @@ static int amdgpu_dri2_get_msc(DrawablePtr draw, CARD64 * ust, CARD64 * msc)
 		*msc = 0;
 		return TRUE;
 	}
-	if (amdgpu_crtc_is_enabled(crtc)) {
-		/* CRTC is running, read vblank counter and timestamp */
-		vbl.request.type = DRM_VBLANK_RELATIVE;
-		vbl.request.type |= amdgpu_populate_vbl_request_type(crtc);
-		vbl.request.sequence = 0;
 
-		ret = drmWaitVBlank(info->dri2.drm_fd, &vbl);
-		if (ret) {
-			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
-				   "get vblank counter failed: %s\n",
-				   strerror(errno));
-			return FALSE;
-		}
-
-		*ust =
-		    ((CARD64) vbl.reply.tval_sec * 1000000) +
-		    vbl.reply.tval_usec;
-		*msc =
-		    vbl.reply.sequence + amdgpu_get_interpolated_vblanks(crtc);
-		*msc &= 0xffffffff;
-	} else {
-		/* CRTC is not running, extrapolate MSC and timestamp */
-		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-		CARD64 now, delta_t, delta_seq;
-
-		if (!drmmode_crtc->dpms_last_ust)
-			return FALSE;
-		ret = drmmode_get_current_ust(info->dri2.drm_fd, &now);
-		if (ret) {
-			xf86DrvMsg(scrn->scrnIndex, X_ERROR,
-				   "%s cannot get current time\n", __func__);
-			return FALSE;
-		}
-		delta_t = now - drmmode_crtc->dpms_last_ust;
-		delta_seq = delta_t * drmmode_crtc->dpms_last_fps;
-		delta_seq /= 1000000;
-		*ust = drmmode_crtc->dpms_last_ust;
-		delta_t = delta_seq * 1000000;
-		delta_t /= drmmode_crtc->dpms_last_fps;
-		*ust += delta_t;
-		*msc = drmmode_crtc->dpms_last_seq;
-		*msc += drmmode_crtc->interpolated_vblanks;
-		*msc += delta_seq;
-		*msc &= 0xffffffff;
-	}
-	return TRUE;
+	return drmmode_crtc_get_ust_msc(crtc, ust, msc);
 }
 
 static
@@ -1006,6 +1328,24 @@ CARD32 amdgpu_dri2_deferred_event(OsTimerPtr timer, CARD32 now, pointer data)
 	return 0;
 }
 
+/* Vblank events go through the DRM event queue, the event data stays owned
+ * by the caller if queueing fails
+ */
+static uintptr_t amdgpu_dri2_queue_event(ScrnInfoPtr scrn,
+					 DRI2FrameEventPtr event)
+{
+	uintptr_t seq;
+
+	seq = amdgpu_drm_queue_alloc(scrn, 0, event,
+				     amdgpu_dri2_frame_event_handler,
+				     amdgpu_dri2_frame_event_abort);
+	if (!seq)
+		xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+			   "Allocating DRM queue event entry failed.\n");
+
+	return seq;
+}
+
 static
 void amdgpu_dri2_schedule_event(CARD32 delay, pointer arg)
 {
@@ -1112,12 +1452,15 @@ static int amdgpu_dri2_schedule_wait_msc(ClientPtr client, DrawablePtr draw,
 		vbl.request.type |= amdgpu_populate_vbl_request_type(crtc);
 		vbl.request.sequence = target_msc;
 		vbl.request.sequence -= amdgpu_get_interpolated_vblanks(crtc);
-		vbl.request.signal = (unsigned long)wait_info;
+		vbl.request.signal = amdgpu_dri2_queue_event(scrn, wait_info);
+		if (!vbl.request.signal)
+			goto out_complete;
 		ret = drmWaitVBlank(info->dri2.drm_fd, &vbl);
 		if (ret) {
 			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
 				   "get vblank counter failed: %s\n",
 				   strerror(errno));
+			amdgpu_drm_remove_entry(vbl.request.signal);
 			goto out_complete;
 		}
 
@@ -1147,11 +1490,14 @@ static int amdgpu_dri2_schedule_wait_msc(ClientPtr client, DrawablePtr draw,
 		vbl.request.sequence += divisor;
 	vbl.request.sequence -= amdgpu_get_interpolated_vblanks(crtc);
 
-	vbl.request.signal = (unsigned long)wait_info;
+	vbl.request.signal = amdgpu_dri2_queue_event(scrn, wait_info);
+	if (!vbl.request.signal)
+		goto out_complete;
 	ret = drmWaitVBlank(info->dri2.drm_fd, &vbl);
 	if (ret) {
 		xf86DrvMsg(scrn->scrnIndex, X_WARNING,
 			   "get vblank counter failed: %s\n", strerror(errno));
+		amdgpu_drm_remove_entry(vbl.request.signal);
 		goto out_complete;
 	}
 
@@ -1281,6 +1627,10 @@ static int amdgpu_dri2_schedule_swap(ClientPtr client, DrawablePtr draw,
 	amdgpu_dri2_ref_buffer(front);
 	amdgpu_dri2_ref_buffer(back);
 
+	/* The client renders its next frame to the back buffer */
+	amdgpu_pixmap_gpu_access(((struct dri2_buffer_priv *)
+				  back->driverPrivate)->pixmap);
+
 	/* either off-screen or CRTC not usable... just complete the swap */
 	if (crtc == NULL)
 		goto blit_fallback;
@@ -1376,12 +1726,15 @@ static int amdgpu_dri2_schedule_swap(ClientPtr client, DrawablePtr draw,
 
 		vbl.request.sequence = *target_msc;
 		vbl.request.sequence -= amdgpu_get_interpolated_vblanks(crtc);
-		vbl.request.signal = (unsigned long)swap_info;
+		vbl.request.signal = amdgpu_dri2_queue_event(scrn, swap_info);
+		if (!vbl.request.signal)
+			goto blit_fallback;
 		ret = drmWaitVBlank(info->dri2.drm_fd, &vbl);
 		if (ret) {
 			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
 				   "divisor 0 get vblank counter failed: %s\n",
 				   strerror(errno));
+			amdgpu_drm_remove_entry(vbl.request.signal);
 			*target_msc = 0;
 			amdgpu_dri2_schedule_event(FALLBACK_SWAP_DELAY,
 						   swap_info);
@@ -1426,12 +1779,15 @@ static int amdgpu_dri2_schedule_swap(ClientPtr client, DrawablePtr draw,
 	/* Account for 1 frame extra pageflip delay if flip > 0 */
 	vbl.request.sequence -= flip;
 
-	vbl.request.signal = (unsigned long)swap_info;
+	vbl.request.signal = amdgpu_dri2_queue_event(scrn, swap_info);
+	if (!vbl.request.signal)
+		goto blit_fallback;
 	ret = drmWaitVBlank(info->dri2.drm_fd, &vbl);
 	if (ret) {
 		xf86DrvMsg(scrn->scrnIndex, X_WARNING,
 			   "final get vblank counter failed: %s\n",
 			   strerror(errno));
+		amdgpu_drm_remove_entry(vbl.request.signal);
 		*target_msc = 0;
 		amdgpu_dri2_schedule_event(FALLBACK_SWAP_DELAY, swap_info);
 		return TRUE;
@@ -1483,6 +1839,18 @@ Bool amdgpu_dri2_screen_init(ScreenPtr pScreen)
 
 	info->dri2.device_name = drmGetDeviceNameFromFd(info->dri2.drm_fd);
 
+	info->dri2.swap_throttle = 1;
+	if (xf86GetOptValInteger(info->Options, OPTION_SWAP_THROTTLE,
+				 &info->dri2.swap_throttle)) {
+		if (info->dri2.swap_throttle < 0)
+			info->dri2.swap_throttle = 0;
+		else if (info->dri2.swap_throttle > AMDGPU_DRI2_THROTTLE_MAX)
+			info->dri2.swap_throttle = AMDGPU_DRI2_THROTTLE_MAX;
+		xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			   "Swap throttle: %d\n", info->dri2.swap_throttle);
+	}
+	info->dri2.sync_file = TRUE;
+
 	dri2_info.driverName = SI_DRIVER_NAME;
 	dri2_info.fd = info->dri2.drm_fd;
 	dri2_info.deviceName = info->dri2.device_name;
@@ -1554,6 +1922,13 @@ Bool amdgpu_dri2_screen_init(ScreenPtr pScreen)
 	}
 #endif
 
+	if (amdgpu_dri2_drawable_generation != serverGeneration) {
+		amdgpu_dri2_drawable_type =
+			CreateNewResourceType(amdgpu_dri2_drawable_gone,
+					      "AMDGPUDRI2Drawable");
+		amdgpu_dri2_drawable_generation = serverGeneration;
+	}
+
 #if DRI2INFOREC_VERSION >= 9
 	dri2_info.version = 9;
 	dri2_info.CreateBuffer2 = amdgpu_dri2_create_buffer2;
@@ -29,12 +29,24 @@
 
 #include <xorg-server.h>
 
+/* Most full window swaps a drawable may have in flight */
+#define AMDGPU_DRI2_THROTTLE_MAX	4
+
 struct amdgpu_dri2 {
 	drmVersionPtr pKernelDRMVersion;
 	int drm_fd;
 	Bool available;
 	Bool enabled;
 	char *device_name;
+
+	/* Full window swaps in flight before the next one waits, 0 for no
+	 * throttling
+	 */
+	int swap_throttle;
+	/* Swaps are throttled with sync_file fences of the front buffer,
+	 * rather than by waiting for it to become idle
+	 */
+	Bool sync_file;
 };
 
 #ifdef DRI2
@@ -0,0 +1,240 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amdgpu_drv.h"
+#include "amdgpu_pixmap.h"
+
+/* DRI3 imports and exports pixmaps through the PRIME pixmap sharing code */
+#if defined(HAVE_DRI3_H) && defined(AMDGPU_PIXMAP_SHARING)
+
+#include "amdgpu_bo_helper.h"
+#include "amdgpu_glamor.h"
+#include "dri3.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+static int open_master_node(ScreenPtr screen, int *out)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	drm_magic_t magic;
+	int fd;
+
+	fd = open(info->dri2.device_name, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return BadAlloc;
+
+	/* With fd passing the server can authenticate the client's fd
+	 * itself before handing it over, instead of the client getting a
+	 * magic number and asking the server to authenticate it.
+	 */
+	if (drmGetMagic(fd, &magic) < 0) {
+		if (errno == EACCES) {
+			/* Assume that we're on a render node, and the fd is
+			 * already as authenticated as it should be.
+			 */
+			*out = fd;
+			return Success;
+		} else {
+			close(fd);
+			return BadMatch;
+		}
+	}
+
+	if (drmAuthMagic(info->dri2.drm_fd, magic) < 0) {
+		close(fd);
+		return BadMatch;
+	}
+
+	*out = fd;
+	return Success;
+}
+
+static int open_render_node(ScreenPtr screen, int *out)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	int fd;
+
+	fd = open(info->render_node, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return BadAlloc;
+
+	*out = fd;
+	return Success;
+}
+
+static int
+amdgpu_dri3_open(ScreenPtr screen, RRProviderPtr provider, int *out)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+
+	if (info->render_node)
+		return open_render_node(screen, out);
+
+	return open_master_node(screen, out);
+}
+
+static PixmapPtr amdgpu_dri3_pixmap_from_fd(ScreenPtr screen, int fd,
+					    CARD16 width, CARD16 height,
+					    CARD16 stride, CARD8 depth,
+					    CARD8 bpp)
+{
+	PixmapPtr pixmap;
+	int handle;
+
+	if (depth < 8)
+		return NULL;
+
+	switch (bpp) {
+	case 8:
+	case 16:
+	case 32:
+		break;
+	default:
+		return NULL;
+	}
+
+	if (width == 0 || height == 0 || width > 32767 || height > 32767 ||
+	    stride < width * bpp / 8)
+		return NULL;
+
+	pixmap = screen->CreatePixmap(screen, 0, 0, depth,
+				      AMDGPU_CREATE_PIXMAP_DRI2);
+	if (!pixmap)
+		return NULL;
+
+	if (!screen->ModifyPixmapHeader(pixmap, width, height, 0, bpp, stride,
+					NULL))
+		goto free_pixmap;
+
+	/* The caller closes fd, the backing helpers take ownership of the
+	 * fd they're passed
+	 */
+	handle = dup(fd);
+	if (handle < 0)
+		goto free_pixmap;
+
+	if (!screen->SetSharedPixmapBacking(pixmap, (void *)(intptr_t)handle))
+		goto free_pixmap;
+
+	return pixmap;
+
+free_pixmap:
+	screen->DestroyPixmap(pixmap);
+	return NULL;
+}
+
+static int amdgpu_dri3_fd_from_pixmap(ScreenPtr screen, PixmapPtr pixmap,
+				      CARD16 *stride, CARD32 *size)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	struct amdgpu_buffer *bo;
+	void *handle;
+
+	bo = amdgpu_get_pixmap_bo(pixmap);
+	if (!bo && info->use_glamor) {
+		/* Texture only pixmap, export the texture storage */
+		if (!amdgpu_glamor_export_pixmap(pixmap))
+			return -1;
+
+		bo = amdgpu_get_pixmap_bo(pixmap);
+	}
+
+	if (!bo)
+		return -1;
+
+	/* User memory can't be shared with other processes */
+	if (bo->flags & AMDGPU_BO_FLAGS_USERPTR)
+		return -1;
+
+	if (pixmap->devKind > UINT16_MAX)
+		return -1;
+
+	if (!amdgpu_share_pixmap_backing(scrn, bo, &handle))
+		return -1;
+
+	*stride = pixmap->devKind;
+	*size = bo->size;
+	return (intptr_t)handle;
+}
+
+static dri3_screen_info_rec amdgpu_dri3_screen_info = {
+	.version = 0,
+
+	.open = amdgpu_dri3_open,
+	.pixmap_from_fd = amdgpu_dri3_pixmap_from_fd,
+	.fd_from_pixmap = amdgpu_dri3_fd_from_pixmap
+};
+
+Bool
+amdgpu_dri3_screen_init(ScreenPtr screen)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+
+	/* Pixmaps from client dma-bufs need the BO pixmap private */
+	if (!dixPrivateKeyRegistered(&amdgpu_pixmap_index))
+		return FALSE;
+
+	info->render_node = drmGetRenderDeviceNameFromFd(info->dri2.drm_fd);
+
+	if (!dri3_screen_init(screen, &amdgpu_dri3_screen_info)) {
+		xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+			   "dri3_screen_init failed\n");
+		free(info->render_node);
+		info->render_node = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+#else /* !HAVE_DRI3_H || !AMDGPU_PIXMAP_SHARING */
+
+Bool
+amdgpu_dri3_screen_init(ScreenPtr screen)
+{
+#ifndef HAVE_DRI3_H
+	xf86DrvMsg(xf86ScreenToScrn(screen)->scrnIndex, X_INFO,
+		   "Can't initialize DRI3 because dri3.h not available at "
+		   "build time\n");
+#else
+	xf86DrvMsg(xf86ScreenToScrn(screen)->scrnIndex, X_INFO,
+		   "Can't initialize DRI3 because the X server doesn't "
+		   "support pixmap sharing\n");
+#endif
+
+	return FALSE;
+}
+
+#endif
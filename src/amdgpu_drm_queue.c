@@ -0,0 +1,151 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <xf86.h>
+#include "amdgpu_drv.h"
+#include "amdgpu_drm_queue.h"
+
+struct amdgpu_drm_queue_entry {
+	struct xorg_list list;
+	uint64_t id;
+	uintptr_t seq;
+	void *data;
+	ScrnInfoPtr scrn;
+	amdgpu_drm_handler_proc handler;
+	amdgpu_drm_abort_proc abort;
+};
+
+/* Shared by all screens, DRM events of all screens go through the same
+ * handler
+ */
+static int amdgpu_drm_queue_refcnt;
+static struct xorg_list amdgpu_drm_queue;
+static uintptr_t amdgpu_drm_queue_seq;
+
+static void amdgpu_drm_queue_abort(struct amdgpu_drm_queue_entry *e)
+{
+	xorg_list_del(&e->list);
+	if (e->abort)
+		e->abort(e->data);
+	free(e);
+}
+
+void amdgpu_drm_queue_handler(int fd, unsigned int frame, unsigned int tv_sec,
+			      unsigned int tv_usec, void *user_data)
+{
+	uintptr_t seq = (uintptr_t)user_data;
+	struct amdgpu_drm_queue_entry *e, *tmp;
+
+	xorg_list_for_each_entry_safe(e, tmp, &amdgpu_drm_queue, list) {
+		if (e->seq != seq)
+			continue;
+
+		xorg_list_del(&e->list);
+		e->handler(frame, tv_sec, tv_usec, e->data);
+		free(e);
+		break;
+	}
+}
+
+uintptr_t amdgpu_drm_queue_alloc(ScrnInfoPtr scrn, uint64_t id, void *data,
+				 amdgpu_drm_handler_proc handler,
+				 amdgpu_drm_abort_proc abort)
+{
+	struct amdgpu_drm_queue_entry *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return 0;
+
+	/* 0 is the failure value */
+	if (!++amdgpu_drm_queue_seq)
+		amdgpu_drm_queue_seq = 1;
+
+	e->seq = amdgpu_drm_queue_seq;
+	e->id = id;
+	e->data = data;
+	e->scrn = scrn;
+	e->handler = handler;
+	e->abort = abort;
+
+	xorg_list_add(&e->list, &amdgpu_drm_queue);
+	return e->seq;
+}
+
+void amdgpu_drm_abort_entry(uintptr_t seq)
+{
+	struct amdgpu_drm_queue_entry *e, *tmp;
+
+	xorg_list_for_each_entry_safe(e, tmp, &amdgpu_drm_queue, list) {
+		if (e->seq == seq) {
+			amdgpu_drm_queue_abort(e);
+			break;
+		}
+	}
+}
+
+void amdgpu_drm_remove_entry(uintptr_t seq)
+{
+	struct amdgpu_drm_queue_entry *e, *tmp;
+
+	xorg_list_for_each_entry_safe(e, tmp, &amdgpu_drm_queue, list) {
+		if (e->seq == seq) {
+			xorg_list_del(&e->list);
+			free(e);
+			break;
+		}
+	}
+}
+
+void amdgpu_drm_abort_id(uint64_t id)
+{
+	struct amdgpu_drm_queue_entry *e, *tmp;
+
+	xorg_list_for_each_entry_safe(e, tmp, &amdgpu_drm_queue, list) {
+		if (e->id == id)
+			amdgpu_drm_queue_abort(e);
+	}
+}
+
+void amdgpu_drm_queue_close(ScrnInfoPtr scrn)
+{
+	struct amdgpu_drm_queue_entry *e, *tmp;
+
+	xorg_list_for_each_entry_safe(e, tmp, &amdgpu_drm_queue, list) {
+		if (e->scrn == scrn)
+			amdgpu_drm_queue_abort(e);
+	}
+
+	amdgpu_drm_queue_refcnt--;
+}
+
+void amdgpu_drm_queue_init(void)
+{
+	if (amdgpu_drm_queue_refcnt++)
+		return;
+
+	xorg_list_init(&amdgpu_drm_queue);
+}
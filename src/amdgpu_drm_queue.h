@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef AMDGPU_DRM_QUEUE_H
+#define AMDGPU_DRM_QUEUE_H 1
+
+#include <stdint.h>
+#include "xf86str.h"
+
+/* Called with the vblank sequence and timestamp of a DRM event */
+typedef void (*amdgpu_drm_handler_proc)(unsigned int frame,
+					unsigned int tv_sec,
+					unsigned int tv_usec, void *data);
+
+/* Called instead of the handler when the event is no longer wanted */
+typedef void (*amdgpu_drm_abort_proc)(void *data);
+
+/* DRM vblank event handler, user_data is the value returned by
+ * amdgpu_drm_queue_alloc
+ */
+extern void amdgpu_drm_queue_handler(int fd, unsigned int frame,
+				     unsigned int tv_sec, unsigned int tv_usec,
+				     void *user_data);
+
+/* Queue an entry for a DRM vblank event
+ *
+ * \param scrn - \c [in] screen the event is for
+ * \param id - \c [in] caller defined identifier, see amdgpu_drm_abort_id
+ * \param data - \c [in] passed to the handler and abort procs
+ * \param abort - \c [in] may be NULL if data needs no cleanup
+ *
+ * \return	value to pass as the DRM event user data
+ *		0 on failure
+ */
+extern uintptr_t amdgpu_drm_queue_alloc(ScrnInfoPtr scrn, uint64_t id,
+					void *data,
+					amdgpu_drm_handler_proc handler,
+					amdgpu_drm_abort_proc abort);
+
+/* Abort the entry returned by amdgpu_drm_queue_alloc, the DRM event is
+ * ignored when it arrives
+ */
+extern void amdgpu_drm_abort_entry(uintptr_t seq);
+
+/* Like amdgpu_drm_abort_entry, but without calling the abort proc, the
+ * caller keeps using the data
+ */
+extern void amdgpu_drm_remove_entry(uintptr_t seq);
+
+/* Abort all entries queued with the given identifier */
+extern void amdgpu_drm_abort_id(uint64_t id);
+
+/* Abort all entries of the screen */
+extern void amdgpu_drm_queue_close(ScrnInfoPtr scrn);
+
+extern void amdgpu_drm_queue_init(void);
+
+#endif /* AMDGPU_DRM_QUEUE_H */
@@ -40,6 +40,7 @@
 #include <stdlib.h>		/* For abs() */
 #include <unistd.h>		/* For usleep() */
 #include <sys/time.h>		/* For gettimeofday() */
+#include <sys/types.h>		/* For dev_t, ino_t */
 
 #include "config.h"
 
@@ -79,6 +80,10 @@
 #include "amdgpu_dri2.h"
 #include "drmmode_display.h"
 #include "amdgpu_bo_helper.h"
+#include "amdgpu_bo_cache.h"
+#include "amdgpu_bo_placement.h"
+#include "amdgpu_bo_predict.h"
+#include "amdgpu_readback.h"
 
 /* Render support */
 #ifdef RENDER
@@ -140,7 +145,11 @@ typedef enum {
 	OPTION_SUBPIXEL_ORDER,
 #endif
 	OPTION_ZAPHOD_HEADS,
-	OPTION_ACCEL_METHOD
+	OPTION_ACCEL_METHOD,
+	OPTION_BO_CACHE_SIZE,
+	OPTION_PIXMAP_POLICY,
+	OPTION_DRI,
+	OPTION_SWAP_THROTTLE
 } AMDGPUOpts;
 
 #define AMDGPU_VSYNC_TIMEOUT	20000	/* Maximum wait for VSYNC (in usecs) */
@@ -156,6 +165,13 @@ typedef enum {
 /* Other macros */
 #define AMDGPU_ARRAY_SIZE(x)  (sizeof(x)/sizeof(x[0]))
 #define AMDGPU_ALIGN(x,bytes) (((x) + ((bytes) - 1)) & ~((bytes) - 1))
+
+/* Tiling parameters for AMDGPU_TILING_SET() on GFX7/8 */
+#define AMDGPU_ARRAY_1D_TILED_THIN1	2
+#define AMDGPU_MICRO_TILE_DISPLAY	0
+#define AMDGPU_MICRO_TILE_DEPTH		2
+#define AMDGPU_MICRO_TILE_HEIGHT	8
+
 #define AMDGPUPTR(pScrn)      ((AMDGPUInfoPtr)(pScrn)->driverPrivate)
 
 #define CURSOR_WIDTH	64
@@ -165,6 +181,10 @@ typedef enum {
 #define CURSOR_HEIGHT_CIK	128
 
 #define AMDGPU_BO_FLAGS_GBM	0x1
+#define AMDGPU_BO_FLAGS_SHARED	0x2	/* flink name or fd handed out */
+#define AMDGPU_BO_FLAGS_DMABUF	0x4	/* dmabuf_fd is valid */
+#define AMDGPU_BO_FLAGS_IMPORTED	0x8	/* in the dma-buf import cache */
+#define AMDGPU_BO_FLAGS_USERPTR	0x10	/* wraps user memory, only kms_handle */
 
 struct amdgpu_buffer {
 	union {
@@ -174,6 +194,47 @@ struct amdgpu_buffer {
 	void *cpu_ptr;
 	uint32_t ref_count;
 	uint32_t flags;
+
+	ScrnInfoPtr scrn;
+	enum amdgpu_bo_usage usage;
+	/* Current preferred domain, 0 if the BO can't be migrated */
+	uint32_t domain;
+
+	/* Cached export handles */
+	uint32_t kms_handle;
+	uint32_t flink_name;
+	int dmabuf_fd;
+
+	/* KMS framebuffer, removed when the BO is destroyed */
+	uint32_t fb_id;
+	int fb_fd;
+	int fb_width;
+	int fb_height;
+	int fb_pitch;
+	int fb_depth;
+	int fb_bpp;
+
+	/* BO cache */
+	struct amdgpu_bo_cache_key cache_key;
+	uint32_t size;
+	CARD32 cache_time;
+	struct xorg_list cache_bucket;
+	struct xorg_list cache_lru;
+
+	/* CPU mapping */
+	uint64_t mmap_offset;
+	uint32_t map_size;
+	uint32_t map_count;
+	struct xorg_list map_lru;
+
+	/* Deferred destruction */
+	CARD32 destroy_time;
+	struct xorg_list destroy_link;
+
+	/* dma-buf import cache, identity of the imported dma-buf */
+	dev_t import_dev;
+	ino_t import_ino;
+	struct xorg_list import_link;
 };
 
 typedef struct {
@@ -194,6 +255,8 @@ typedef struct {
 
 	Bool directRenderingEnabled;
 	struct amdgpu_dri2 dri2;
+	Bool dri3_enabled;
+	char *render_node;
 
 	/* accel */
 	Bool use_glamor;
@@ -214,7 +277,30 @@ typedef struct {
 	struct amdgpu_buffer *cursor_buffer[32];
 
 	uint64_t vram_size;
+	uint64_t vram_visible_size;
 	uint64_t gart_size;
+	struct amdgpu_bo_cache bo_cache;
+
+	/* CPU mappings nobody holds, unmapped when over budget */
+	struct xorg_list bo_map_lru;
+	uint64_t bo_map_size;
+	uint64_t bo_map_budget;
+
+	/* BOs waiting to be freed from the BlockHandler */
+	struct xorg_list bo_destroy_queue;
+	unsigned bo_destroy_count;
+	Bool bo_destroy_enabled;
+	struct amdgpu_bo_placement placement;
+
+	/* BOs imported from dma-bufs, looked up by the dma-buf inode */
+	struct xorg_list bo_imports;
+	Bool bo_imports_enabled;
+	unsigned long bo_import_hits;
+	unsigned long bo_import_misses;
+
+	struct amdgpu_bo_predict bo_predict;
+	struct amdgpu_readback readback;
+
 	drmmode_rec drmmode;
 	Bool drmmode_inited;
 	/* r6xx+ tile config */
@@ -223,6 +309,7 @@ typedef struct {
 
 	/* kms pageflipping */
 	Bool allowPageFlip;
+	Bool present_async_flip;
 
 	/* cursor size */
 	int cursor_w;
@@ -230,6 +317,12 @@ typedef struct {
 } AMDGPUInfoRec, *AMDGPUInfoPtr;
 
 
+/* amdgpu_dri3.c */
+Bool amdgpu_dri3_screen_init(ScreenPtr screen);
+
+/* amdgpu_present.c */
+Bool amdgpu_present_screen_init(ScreenPtr screen);
+
 /* amdgpu_video.c */
 extern void AMDGPUInitVideo(ScreenPtr pScreen);
 extern void AMDGPUResetVideo(ScrnInfoPtr pScrn);
@@ -36,6 +36,11 @@
 #include "amdgpu_pixmap.h"
 
 #include <gbm.h>
+#include <unistd.h>
+
+#ifdef MITSHM
+#include "shmint.h"
+#endif
 
 #if HAS_DEVPRIVATEKEYREC
 DevPrivateKeyRec amdgpu_pixmap_index;
@@ -52,11 +57,53 @@ void amdgpu_glamor_exchange_buffers(PixmapPtr src, PixmapPtr dst)
 	glamor_egl_exchange_buffers(src, dst);
 }
 
+/* Attach a BO to a texture-only pixmap by exporting the storage of its
+ * existing texture, so its contents don't need to be copied to a new BO.
+ * Returns FALSE if glamor can't export the texture.
+ */
+Bool amdgpu_glamor_export_pixmap(PixmapPtr pixmap)
+{
+#ifdef HAVE_GLAMOR_EGL_DRI3_FD_NAME_FROM_TEX
+	ScreenPtr screen = pixmap->drawable.pScreen;
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	struct amdgpu_pixmap *priv = amdgpu_get_pixmap_private(pixmap);
+	struct amdgpu_buffer *bo;
+	unsigned int tex;
+	CARD16 stride;
+	CARD32 size;
+	int fd;
+
+	tex = glamor_get_pixmap_texture(pixmap);
+	if (!tex)
+		return FALSE;
+
+	fd = glamor_egl_dri3_fd_name_from_tex(screen, pixmap, tex, FALSE,
+					      &stride, &size);
+	if (fd < 0)
+		return FALSE;
+
+	bo = amdgpu_bo_import_dmabuf(scrn, fd, size);
+	close(fd);
+	if (!bo)
+		return FALSE;
+
+	amdgpu_set_pixmap_bo(pixmap, bo);
+	amdgpu_bo_unref(&bo);
+	priv->stride = stride;
+
+	screen->ModifyPixmapHeader(pixmap, pixmap->drawable.width,
+				   pixmap->drawable.height, 0, 0, stride, NULL);
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
 Bool amdgpu_glamor_create_screen_resources(ScreenPtr screen)
 {
 	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
 	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
-	union gbm_bo_handle bo_handle;
+	uint32_t bo_handle;
 
 	if (!info->use_glamor)
 		return TRUE;
@@ -64,9 +111,11 @@ Bool amdgpu_glamor_create_screen_resources(ScreenPtr screen)
 	if (!glamor_glyphs_init(screen))
 		return FALSE;
 
-	bo_handle = gbm_bo_get_handle(info->front_buffer->bo.gbm);
+	if (!amdgpu_bo_get_handle(info->front_buffer, &bo_handle))
+		return FALSE;
+
 	if (!glamor_egl_create_textured_screen_ext(screen,
-						   bo_handle.u32,
+						   bo_handle,
 						   scrn->displayWidth *
 						   info->pixel_bytes, NULL)) {
 		return FALSE;
@@ -130,7 +179,7 @@ Bool amdgpu_glamor_create_textured_pixmap(PixmapPtr pixmap)
 	ScrnInfoPtr scrn = xf86ScreenToScrn(pixmap->drawable.pScreen);
 	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
 	struct amdgpu_pixmap *priv;
-	union gbm_bo_handle bo_handle;
+	uint32_t bo_handle;
 
 	if ((info->use_glamor) == 0)
 		return TRUE;
@@ -140,8 +189,10 @@ Bool amdgpu_glamor_create_textured_pixmap(PixmapPtr pixmap)
 		priv->stride = pixmap->devKind;
 	}
 
-	bo_handle = gbm_bo_get_handle(priv->bo->bo.gbm);
-	if (glamor_egl_create_textured_pixmap(pixmap, bo_handle.u32,
+	if (!amdgpu_bo_get_handle(priv->bo, &bo_handle))
+		return FALSE;
+
+	if (glamor_egl_create_textured_pixmap(pixmap, bo_handle,
 					      priv->stride)) {
 		return TRUE;
 	} else {
@@ -151,8 +202,7 @@ Bool amdgpu_glamor_create_textured_pixmap(PixmapPtr pixmap)
 
 Bool amdgpu_glamor_pixmap_is_offscreen(PixmapPtr pixmap)
 {
-	struct amdgpu_pixmap *priv = amdgpu_get_pixmap_private(pixmap);
-	return priv && priv->bo;
+	return amdgpu_get_pixmap_bo(pixmap) != NULL;
 }
 
 #ifndef CREATE_PIXMAP_USAGE_SHARED
@@ -167,10 +217,13 @@ amdgpu_glamor_create_pixmap(ScreenPtr screen, int w, int h, int depth,
 			    unsigned usage)
 {
 	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
 	struct amdgpu_pixmap *priv;
 	PixmapPtr pixmap, new_pixmap = NULL;
 
-	if (!AMDGPU_CREATE_PIXMAP_SHARED(usage)) {
+	if (!AMDGPU_CREATE_PIXMAP_SHARED(usage) &&
+	    amdgpu_bo_placement_policy(info,
+				       amdgpu_bo_placement_usage(usage))->texture) {
 		pixmap = glamor_create_pixmap(screen, w, h, depth, usage);
 		if (pixmap)
 			return pixmap;
@@ -190,17 +243,12 @@ amdgpu_glamor_create_pixmap(ScreenPtr screen, int w, int h, int depth,
 		return pixmap;
 
 	if (w && h) {
-		priv = calloc(1, sizeof(struct amdgpu_pixmap));
-		if (priv == NULL)
-			goto fallback_pixmap;
-
+		priv = amdgpu_get_pixmap_private(pixmap);
 		priv->bo = amdgpu_alloc_pixmap_bo(scrn, w, h, depth, usage,
 						  pixmap->drawable.bitsPerPixel,
 						  &priv->stride);
 		if (!priv->bo)
-			goto fallback_priv;
-
-		amdgpu_set_pixmap_private(pixmap, priv);
+			goto fallback_pixmap;
 
 		screen->ModifyPixmapHeader(pixmap, w, h, 0, 0, priv->stride,
 					   NULL);
@@ -231,9 +279,7 @@ fallback_glamor:
 	 * afterwards.
 	 */
 	new_pixmap = glamor_create_pixmap(screen, w, h, depth, usage);
-	amdgpu_bo_unref(&priv->bo);
-fallback_priv:
-	free(priv);
+	amdgpu_set_pixmap_bo(pixmap, NULL);
 fallback_pixmap:
 	fbDestroyPixmap(pixmap);
 	if (new_pixmap)
@@ -242,6 +288,65 @@ fallback_pixmap:
 		return fbCreatePixmap(screen, w, h, depth, usage);
 }
 
+#ifdef MITSHM
+
+/* Wrap the SHM segment as a userptr BO, so that glamor samples straight
+ * from it instead of uploading the pixels first
+ */
+static PixmapPtr
+amdgpu_glamor_shm_create_pixmap(ScreenPtr screen, int w, int h, int depth,
+				char *addr)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	int bpp = BitsPerPixel(depth);
+	int stride = PixmapBytePad(w, depth);
+	struct amdgpu_pixmap *priv;
+	struct amdgpu_buffer *bo;
+	PixmapPtr pixmap;
+
+	/* Like fbShmCreatePixmap, so that glamor sets up its private */
+	pixmap = (*screen->CreatePixmap)(screen, 0, 0, depth, 0);
+	if (pixmap == NullPixmap)
+		return pixmap;
+
+	if (!screen->ModifyPixmapHeader(pixmap, w, h, depth, bpp, stride,
+					addr)) {
+		screen->DestroyPixmap(pixmap);
+		return NullPixmap;
+	}
+
+	/* Otherwise it stays a plain memory pixmap, as without us */
+	if (bpp < 8 || !w || !h || ((uintptr_t)addr & 4095) ||
+	    stride % (drmmode_get_pitch_align(scrn, bpp / 8) * bpp / 8))
+		return pixmap;
+
+	bo = amdgpu_bo_from_user_mem(scrn, addr,
+				     AMDGPU_ALIGN(stride * h, 4096));
+	if (!bo)
+		return pixmap;
+
+	amdgpu_set_pixmap_bo(pixmap, bo);
+	amdgpu_bo_unref(&bo);
+	priv = amdgpu_get_pixmap_private(pixmap);
+	priv->stride = stride;
+
+	if (!amdgpu_glamor_create_textured_pixmap(pixmap)) {
+		amdgpu_set_pixmap_bo(pixmap, NULL);
+		return pixmap;
+	}
+
+	/* Like other BO pixmaps, glamor handles CPU access */
+	pixmap->devPrivate.ptr = NULL;
+	return pixmap;
+}
+
+static ShmFuncs amdgpu_glamor_shm_funcs = {
+	amdgpu_glamor_shm_create_pixmap,
+	NULL
+};
+
+#endif /* MITSHM */
+
 static Bool amdgpu_glamor_destroy_pixmap(PixmapPtr pixmap)
 {
 	if (pixmap->refcnt == 1) {
@@ -260,10 +365,11 @@ amdgpu_glamor_share_pixmap_backing(PixmapPtr pixmap, ScreenPtr slave,
 {
 	struct amdgpu_pixmap *priv = amdgpu_get_pixmap_private(pixmap);
 
-	if (!priv)
+	if (!priv->bo)
 		return FALSE;
 
-	return amdgpu_share_pixmap_backing(priv->bo, handle_p);
+	return amdgpu_share_pixmap_backing(xf86ScreenToScrn(pixmap->drawable.pScreen),
+					   priv->bo, handle_p);
 }
 
 static Bool
@@ -317,9 +423,11 @@ Bool amdgpu_glamor_init(ScreenPtr screen)
 		return FALSE;
 	}
 #if HAS_DIXREGISTERPRIVATEKEY
-	if (!dixRegisterPrivateKey(&amdgpu_pixmap_index, PRIVATE_PIXMAP, 0))
+	if (!dixRegisterPrivateKey(&amdgpu_pixmap_index, PRIVATE_PIXMAP,
+				   sizeof(struct amdgpu_pixmap)))
 #else
-	if (!dixRequestPrivate(&amdgpu_pixmap_index, 0))
+	if (!dixRequestPrivate(&amdgpu_pixmap_index,
+			       sizeof(struct amdgpu_pixmap)))
 #endif
 		return FALSE;
 
@@ -330,6 +438,9 @@ Bool amdgpu_glamor_init(ScreenPtr screen)
 	screen->SetSharedPixmapBacking =
 	    amdgpu_glamor_set_shared_pixmap_backing;
 #endif
+#ifdef MITSHM
+	ShmRegisterFuncs(screen, &amdgpu_glamor_shm_funcs);
+#endif
 
 	xf86DrvMsg(scrn->scrnIndex, X_INFO, "Use GLAMOR acceleration.\n");
 	return TRUE;
@@ -38,6 +38,7 @@ void amdgpu_glamor_flush(ScrnInfoPtr pScrn);
 
 Bool amdgpu_glamor_create_textured_pixmap(PixmapPtr pixmap);
 void amdgpu_glamor_exchange_buffers(PixmapPtr src, PixmapPtr dst);
+Bool amdgpu_glamor_export_pixmap(PixmapPtr pixmap);
 
 Bool amdgpu_glamor_pixmap_is_offscreen(PixmapPtr pixmap);
 
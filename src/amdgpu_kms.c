@@ -64,6 +64,10 @@ const OptionInfoRec AMDGPUOptions_KMS[] = {
 	{OPTION_SUBPIXEL_ORDER, "SubPixelOrder", OPTV_ANYSTR, {0}, FALSE},
 	{OPTION_ZAPHOD_HEADS, "ZaphodHeads", OPTV_STRING, {0}, FALSE},
 	{OPTION_ACCEL_METHOD, "AccelMethod", OPTV_STRING, {0}, FALSE},
+	{OPTION_BO_CACHE_SIZE, "BOCacheSize", OPTV_INTEGER, {0}, FALSE},
+	{OPTION_PIXMAP_POLICY, "PixmapPolicy", OPTV_STRING, {0}, FALSE},
+	{OPTION_DRI, "DRI", OPTV_INTEGER, {0}, FALSE},
+	{OPTION_SWAP_THROTTLE, "SwapThrottle", OPTV_INTEGER, {0}, FALSE},
 	{-1, NULL, OPTV_NONE, {0}, FALSE}
 };
 
@@ -223,6 +227,11 @@ static void AMDGPUBlockHandler_KMS(BLOCKHANDLER_ARGS_DECL)
 #ifdef AMDGPU_PIXMAP_SHARING
 	amdgpu_dirty_update(pScreen);
 #endif
+
+	amdgpu_bo_cache_expire(pScrn);
+	amdgpu_bo_destroy_queue_drain(pScrn, FALSE);
+	amdgpu_bo_predict_refill(pScrn);
+	amdgpu_heap_alloc_report(pScrn);
 }
 
 static void
@@ -542,8 +551,10 @@ Bool AMDGPUPreInit_KMS(ScrnInfoPtr pScrn, int flags)
 
 	AMDGPUSetupCapabilities(pScrn);
 
-	/* don't enable tiling if accel is not enabled */
-	if (info->use_glamor) {
+	/* don't enable tiling if accel is not enabled, DRI2 clients
+	 * still benefit from it without glamor
+	 */
+	if (info->use_glamor || info->dri2.available) {
 		/* set default group bytes, overridden by kernel info below */
 		info->group_bytes = 256;
 		info->have_tiling_info = FALSE;
@@ -572,18 +583,22 @@ Bool AMDGPUPreInit_KMS(ScrnInfoPtr pScrn, int flags)
 	info->cursor_w = CURSOR_WIDTH_CIK;
 	info->cursor_h = CURSOR_HEIGHT_CIK;
 
-	amdgpu_query_heap_size(pAMDGPUEnt->pDev, AMDGPU_GEM_DOMAIN_GTT,
+	amdgpu_query_heap_size(pAMDGPUEnt->pDev, AMDGPU_GEM_DOMAIN_GTT, 0,
 				&heap_size, &max_allocation);
 	info->gart_size = heap_size;
+	amdgpu_query_heap_size(pAMDGPUEnt->pDev, AMDGPU_GEM_DOMAIN_VRAM, 0,
+				&heap_size, &max_allocation);
+	info->vram_size = heap_size;
 	amdgpu_query_heap_size(pAMDGPUEnt->pDev, AMDGPU_GEM_DOMAIN_VRAM,
+				AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED,
 				&heap_size, &max_allocation);
-	info->vram_size = max_allocation;
+	info->vram_visible_size = heap_size;
 
 	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
 		   "mem size init: gart size :%llx vram size: s:%llx visible:%llx\n",
 		   (unsigned long long)info->gart_size,
-		   (unsigned long long)heap_size,
-		   (unsigned long long)max_allocation);
+		   (unsigned long long)info->vram_size,
+		   (unsigned long long)info->vram_visible_size);
 
 	cpp = pScrn->bitsPerPixel / 8;
 	pScrn->displayWidth =
@@ -716,6 +731,15 @@ static Bool AMDGPUCloseScreen_KMS(CLOSE_SCREEN_ARGS_DECL)
 	if (info->dri2.enabled) {
 		amdgpu_dri2_close_screen(pScreen);
 	}
+	free(info->render_node);
+	info->render_node = NULL;
+	info->dri3_enabled = FALSE;
+	amdgpu_bo_predict_fini(pScrn);
+	amdgpu_readback_fini(pScrn);
+	amdgpu_bo_cache_fini(pScrn);
+	amdgpu_bo_placement_fini(pScrn);
+	amdgpu_bo_import_fini(pScrn);
+	amdgpu_bo_destroy_queue_fini(pScrn);
 	pScrn->vtSema = FALSE;
 	xf86ClearPrimInitDone(info->pEnt->index);
 	pScreen->BlockHandler = info->BlockHandler;
@@ -765,6 +789,13 @@ Bool AMDGPUScreenInit_KMS(SCREEN_INIT_ARGS_DECL)
 	if (info->shadow_fb == FALSE)
 		info->directRenderingEnabled = amdgpu_dri2_screen_init(pScreen);
 
+	amdgpu_bo_cache_init(pScrn);
+	amdgpu_bo_map_init(pScrn);
+	amdgpu_bo_placement_init(pScrn);
+	amdgpu_bo_destroy_queue_init(pScrn);
+	amdgpu_bo_import_init(pScrn);
+	amdgpu_bo_predict_init(pScrn);
+
 	if (!amdgpu_setup_kernel_mem(pScreen)) {
 		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
 			   "amdgpu_setup_kernel_mem failed\n");
@@ -864,6 +895,33 @@ Bool AMDGPUScreenInit_KMS(SCREEN_INIT_ARGS_DECL)
 		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "2D and 3D cceleration disabled\n");
 	}
 
+	info->dri3_enabled = FALSE;
+	if (info->directRenderingEnabled) {
+		MessageType from = X_DEFAULT;
+		int dri_level = 3;
+
+		if (xf86GetOptValInteger(info->Options, OPTION_DRI, &dri_level))
+			from = X_CONFIG;
+
+		/* Without glamor, fb would read the tiled BOs clients
+		 * allocate as linear
+		 */
+		if (dri_level >= 3 && info->use_glamor)
+			info->dri3_enabled = amdgpu_dri3_screen_init(pScreen);
+
+		xf86DrvMsg(pScrn->scrnIndex, from, "DRI3 %sabled\n",
+			   info->dri3_enabled ? "en" : "dis");
+
+		amdgpu_present_screen_init(pScreen);
+	}
+
+	/* CPU reads of the front buffer go through a write-combined mapping.
+	 * This has to wrap GetImage before the cursor code does, so that a
+	 * software cursor is removed before we read the front buffer.
+	 */
+	if (!info->shadow_fb && !info->use_glamor)
+		amdgpu_readback_init(pScreen);
+
 	/* Init DPMS */
 	xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
 		       "Initializing DPMS\n");
@@ -1018,7 +1076,7 @@ static Bool amdgpu_setup_kernel_mem(ScreenPtr pScreen)
 		/* cursor objects */
 		if (info->cursor_buffer[c] == NULL) {
 			if (info->gbm) {
-				info->cursor_buffer[c] = (struct amdgpu_buffer *)calloc(1, sizeof(struct amdgpu_buffer));
+				info->cursor_buffer[c] = amdgpu_bo_header_alloc();
 				if (!info->cursor_buffer[c]) {
 					return FALSE;
 				}
@@ -1032,15 +1090,17 @@ static Bool amdgpu_setup_kernel_mem(ScreenPtr pScreen)
 				if (!info->cursor_buffer[c]->bo.gbm) {
 					xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
 						   "Failed to allocate cursor buffer memory\n");
-					free(info->cursor_buffer[c]);
+					amdgpu_bo_header_free(info->cursor_buffer[c]);
 					return FALSE;
 				}
+				info->cursor_buffer[c]->flags |= AMDGPU_BO_FLAGS_GBM;
 			} else {
 				AMDGPUEntPtr pAMDGPUEnt = AMDGPUEntPriv(pScrn);
 				info->cursor_buffer[c] = amdgpu_bo_open(pAMDGPUEnt->pDev,
 									cursor_size,
 									0,
-									AMDGPU_GEM_DOMAIN_VRAM);
+									AMDGPU_GEM_DOMAIN_VRAM,
+									AMDGPU_GEM_CREATE_CPU_ACCESS_REQUIRED);
 				if (!(info->cursor_buffer[c])) {
 					ErrorF("Failed to allocate cursor buffer memory\n");
 					return FALSE;
@@ -1059,7 +1119,10 @@ static Bool amdgpu_setup_kernel_mem(ScreenPtr pScreen)
 
 	if (info->front_buffer == NULL) {
 		int pitch;
-		int hint = info->use_glamor ? 0 : AMDGPU_CREATE_PIXMAP_LINEAR;
+		int hint = AMDGPU_CREATE_PIXMAP_SCANOUT;
+
+		if (!info->use_glamor)
+			hint |= AMDGPU_CREATE_PIXMAP_LINEAR;
 
 		info->front_buffer =
 			amdgpu_alloc_pixmap_bo(pScrn, pScrn->virtualX,
@@ -53,43 +53,126 @@ amdgpu_pixmap_create(ScreenPtr screen, int w, int h, int depth,	unsigned usage)
 		return pixmap;
 
 	if (w && h) {
-		priv = calloc(1, sizeof(struct amdgpu_pixmap));
-		if (priv == NULL)
-			goto fallback_pixmap;
-
+		priv = amdgpu_get_pixmap_private(pixmap);
 		scrn = xf86ScreenToScrn(screen);
 		info = AMDGPUPTR(scrn);
-		if (!info->use_glamor)
+		/* fb copies from and to DRI2 buffers, except for depth and
+		 * stencil buffers, which can be tiled
+		 */
+		if (!info->use_glamor && !(usage & AMDGPU_CREATE_PIXMAP_DEPTH))
 			usage |= AMDGPU_CREATE_PIXMAP_LINEAR;
 		priv->bo = amdgpu_alloc_pixmap_bo(scrn, w, h, depth, usage,
 						pixmap->drawable.bitsPerPixel,
 						&priv->stride);
 		if (!priv->bo)
-			goto fallback_priv;
-
-		amdgpu_set_pixmap_private(pixmap, priv);
-
-		if (amdgpu_bo_map(scrn, priv->bo)) {
-			ErrorF("Failed to mmap the bo\n");
-			goto fallback_bo;
-		}
+			goto fallback_pixmap;
 
+		/* DRI2 buffers are mostly rendered to by the client only, so
+		 * don't map the BO until the server needs to access it
+		 */
 		screen->ModifyPixmapHeader(pixmap, w, h,
-				0, 0, priv->stride,
-				priv->bo->cpu_ptr);
+				0, 0, priv->stride, NULL);
+		pixmap->devPrivate.ptr = NULL;
 	}
 
 	return pixmap;
 
-fallback_bo:
-	amdgpu_bo_unref(&priv->bo);
-fallback_priv:
-	free(priv);
 fallback_pixmap:
 	fbDestroyPixmap(pixmap);
 	return fbCreatePixmap(screen, w, h, depth, usage);
 }
 
+/* Reads from write-combined VRAM mappings are uncached, so pixmaps the CPU
+ * keeps reading are better off in cacheable GTT
+ */
+static void amdgpu_pixmap_cpu_access(ScrnInfoPtr scrn, PixmapPtr pixmap,
+				     Bool write, const BoxRec *box)
+{
+	struct amdgpu_pixmap *priv = amdgpu_get_pixmap_private(pixmap);
+	int cpp = pixmap->drawable.bitsPerPixel / 8;
+
+	if (box)
+		priv->cpu_bytes += (uint64_t)(box->x2 - box->x1) *
+			(box->y2 - box->y1) * cpp;
+	else
+		priv->cpu_bytes += (uint64_t)pixmap->drawable.width *
+			pixmap->drawable.height * cpp;
+
+	if (write) {
+		priv->cpu_writes++;
+		return;
+	}
+
+	priv->cpu_reads++;
+	if (priv->bo->domain == AMDGPU_GEM_DOMAIN_VRAM &&
+	    priv->read_periods + 1 >= AMDGPU_PIXMAP_MIGRATE_PERIODS &&
+	    priv->cpu_reads >= AMDGPU_PIXMAP_MIGRATE_READS &&
+	    priv->cpu_bytes >= AMDGPU_PIXMAP_MIGRATE_BYTES)
+		amdgpu_bo_placement_migrate(scrn, priv->bo,
+					    AMDGPU_GEM_DOMAIN_GTT);
+}
+
+void amdgpu_pixmap_gpu_access(PixmapPtr pixmap)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(pixmap->drawable.pScreen);
+	struct amdgpu_pixmap *priv = amdgpu_get_pixmap_private(pixmap);
+
+	if (AMDGPUPTR(scrn)->use_glamor || !priv->bo)
+		return;
+
+	if (priv->cpu_reads >= AMDGPU_PIXMAP_MIGRATE_READS &&
+	    priv->cpu_bytes >= AMDGPU_PIXMAP_MIGRATE_BYTES) {
+		if (priv->read_periods < AMDGPU_PIXMAP_MIGRATE_PERIODS)
+			priv->read_periods++;
+	} else if (priv->read_periods > 0) {
+		priv->read_periods--;
+	}
+
+	priv->cpu_reads = 0;
+	priv->cpu_writes = 0;
+	priv->cpu_bytes = 0;
+
+	if (priv->read_periods == 0 && amdgpu_bo_placement_migrated(priv->bo))
+		amdgpu_bo_placement_migrate(scrn, priv->bo,
+					    priv->bo->cache_key.domain);
+}
+
+Bool amdgpu_pixmap_prepare_access(PixmapPtr pixmap, Bool write,
+				  const BoxRec *box)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(pixmap->drawable.pScreen);
+	struct amdgpu_pixmap *priv = amdgpu_get_pixmap_private(pixmap);
+
+	if (AMDGPUPTR(scrn)->use_glamor || !priv->bo || pixmap->devPrivate.ptr)
+		return TRUE;
+
+	amdgpu_pixmap_cpu_access(scrn, pixmap, write, box);
+
+	if (amdgpu_bo_map(scrn, priv->bo)) {
+		ErrorF("Failed to mmap the bo\n");
+		return FALSE;
+	}
+
+	pixmap->devPrivate.ptr = priv->bo->cpu_ptr;
+	priv->mapped = TRUE;
+	return TRUE;
+}
+
+void amdgpu_pixmap_finish_access(PixmapPtr pixmap)
+{
+	struct amdgpu_pixmap *priv = amdgpu_get_pixmap_private(pixmap);
+
+	if (!priv->mapped)
+		return;
+
+	/* The mapping is kept around for the next access, unless we run
+	 * out of mapping budget before that
+	 */
+	amdgpu_bo_map_release(priv->bo);
+	pixmap->devPrivate.ptr = NULL;
+	priv->mapped = FALSE;
+}
+
 static Bool amdgpu_pixmap_destroy(PixmapPtr pixmap)
 {
 	if (pixmap->refcnt == 1) {
@@ -103,9 +186,11 @@ static Bool amdgpu_pixmap_destroy(PixmapPtr pixmap)
 Bool amdgpu_pixmap_init(ScreenPtr screen)
 {
 #if HAS_DIXREGISTERPRIVATEKEY
-	if (!dixRegisterPrivateKey(&amdgpu_pixmap_index, PRIVATE_PIXMAP, 0))
+	if (!dixRegisterPrivateKey(&amdgpu_pixmap_index, PRIVATE_PIXMAP,
+				   sizeof(struct amdgpu_pixmap)))
 #else
-	if (!dixRequestPrivate(&amdgpu_pixmap_index, 0))
+	if (!dixRequestPrivate(&amdgpu_pixmap_index,
+			       sizeof(struct amdgpu_pixmap)))
 #endif
 		return FALSE;
 
@@ -31,29 +31,45 @@
 struct amdgpu_pixmap {
 	struct amdgpu_buffer *bo;
 	int stride;
+	/* devPrivate.ptr points to a mapping from prepare_access */
+	Bool mapped;
+	/* CPU accesses since the GPU last used the pixmap */
+	unsigned cpu_reads;
+	unsigned cpu_writes;
+	uint64_t cpu_bytes;
+	/* Recent GPU uses with heavy CPU reads in between */
+	unsigned read_periods;
 };
 
+/* The CPU reads a pixmap heavily if it reads it this often, and touches at
+ * least this many bytes, between two GPU uses. Copying a DRI2 back buffer
+ * once per swap doesn't count.
+ */
+#define AMDGPU_PIXMAP_MIGRATE_READS	2
+#define AMDGPU_PIXMAP_MIGRATE_BYTES	(256 * 1024)
+/* Move a DRI2 pixmap BO out of VRAM after this many GPU uses with heavy CPU
+ * reads in between, and back once there were as many without
+ */
+#define AMDGPU_PIXMAP_MIGRATE_PERIODS	4
+
 #if HAS_DEVPRIVATEKEYREC
 extern DevPrivateKeyRec amdgpu_pixmap_index;
 #else
 extern int amdgpu_pixmap_index;
 #endif
 
+/* The private is allocated along with the pixmap, a pixmap without a BO
+ * has a zeroed private
+ */
 static inline struct amdgpu_pixmap *amdgpu_get_pixmap_private(PixmapPtr pixmap)
 {
 #if HAS_DEVPRIVATEKEYREC
-	return dixGetPrivate(&pixmap->devPrivates, &amdgpu_pixmap_index);
+	return dixGetPrivateAddr(&pixmap->devPrivates, &amdgpu_pixmap_index);
 #else
 	return dixLookupPrivate(&pixmap->devPrivates, &amdgpu_pixmap_index);
 #endif
 }
 
-static inline void amdgpu_set_pixmap_private(PixmapPtr pixmap,
-					     struct amdgpu_pixmap *priv)
-{
-	dixSetPrivate(&pixmap->devPrivates, &amdgpu_pixmap_index, priv);
-}
-
 #if XF86_CRTC_VERSION >= 5
 #define AMDGPU_PIXMAP_SHARING 1
 #endif
@@ -63,48 +79,49 @@ static inline void amdgpu_set_pixmap_bo(PixmapPtr pPix, struct amdgpu_buffer *bo
 	struct amdgpu_pixmap *priv;
 
 	priv = amdgpu_get_pixmap_private(pPix);
-	if (priv == NULL && bo == NULL)
+	if (priv->bo == bo)
 		return;
 
-	if (priv) {
-		if (priv->bo == bo)
-			return;
-
-		if (priv->bo) {
-			amdgpu_bo_unref(&priv->bo);
-		}
-
-		if (!bo) {
-			free(priv);
-			priv = NULL;
-		}
+	if (priv->bo) {
+		amdgpu_bo_unref(&priv->bo);
 	}
 
 	if (bo) {
-		if (!priv) {
-			priv = calloc(1, sizeof(struct amdgpu_pixmap));
-			if (!priv)
-				goto out;
-		}
 		amdgpu_bo_ref(bo);
 		priv->bo = bo;
-	}
-out:
-	amdgpu_set_pixmap_private(pPix, priv);
+	} else
+		priv->stride = 0;
 }
 
 static inline struct amdgpu_buffer *amdgpu_get_pixmap_bo(PixmapPtr pPix)
 {
-	struct amdgpu_pixmap *priv;
-	priv = amdgpu_get_pixmap_private(pPix);
-	return priv ? priv->bo : NULL;
+	return amdgpu_get_pixmap_private(pPix)->bo;
 }
 
 enum {
 	AMDGPU_CREATE_PIXMAP_DRI2 = 0x08000000,
-	AMDGPU_CREATE_PIXMAP_LINEAR = 0x04000000
+	AMDGPU_CREATE_PIXMAP_LINEAR = 0x04000000,
+	AMDGPU_CREATE_PIXMAP_SCANOUT = 0x02000000,
+	/* DRI2 depth or stencil buffer, never accessed by the CPU */
+	AMDGPU_CREATE_PIXMAP_DEPTH = 0x01000000
 };
 
 extern Bool amdgpu_pixmap_init(ScreenPtr screen);
 
+/* Without glamor, DRI2 pixmaps are only mapped for CPU access between these.
+ * Pixmaps which are always accessible are left alone.
+ *
+ * \param pixmap - \c [in] pixmap to access
+ * \param write - \c [in] whether the CPU writes to the pixmap
+ * \param box - \c [in] area accessed, NULL for the whole pixmap
+ */
+extern Bool amdgpu_pixmap_prepare_access(PixmapPtr pixmap, Bool write,
+					 const BoxRec *box);
+extern void amdgpu_pixmap_finish_access(PixmapPtr pixmap);
+
+/* Called when the GPU is about to use the pixmap again. Moves it back to
+ * VRAM if the CPU has stopped reading it.
+ */
+extern void amdgpu_pixmap_gpu_access(PixmapPtr pixmap);
+
 #endif /* AMDGPU_PIXMAP_H */
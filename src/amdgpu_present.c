@@ -0,0 +1,415 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "amdgpu_drv.h"
+
+#ifdef HAVE_PRESENT_H
+
+#include <poll.h>
+#include <errno.h>
+
+#include "amdgpu_drm_queue.h"
+#include "amdgpu_glamor.h"
+#include "amdgpu_pixmap.h"
+#include "amdgpu_video.h"
+
+#include "present.h"
+
+#ifndef DRM_CAP_ASYNC_PAGE_FLIP
+#define DRM_CAP_ASYNC_PAGE_FLIP 0x7
+#endif
+
+struct amdgpu_present_vblank_event {
+	uint64_t event_id;
+	xf86CrtcPtr crtc;
+};
+
+static RRCrtcPtr
+amdgpu_present_get_crtc(WindowPtr window)
+{
+	ScreenPtr screen = window->drawable.pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(screen);
+	xf86CrtcPtr crtc;
+
+	crtc = amdgpu_pick_best_crtc(pScrn, FALSE,
+				     window->drawable.x,
+				     window->drawable.x + window->drawable.width,
+				     window->drawable.y,
+				     window->drawable.y + window->drawable.height);
+
+	/* Make sure the CRTC is valid and this is the real front buffer */
+	if (crtc != NULL && !crtc->rotatedData)
+		return crtc->randr_crtc;
+
+	return NULL;
+}
+
+static int
+amdgpu_present_get_ust_msc(RRCrtcPtr crtc, CARD64 *ust, CARD64 *msc)
+{
+	xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+
+	if (!drmmode_crtc_get_ust_msc(xf86_crtc, ust, msc))
+		return BadMatch;
+
+	return Success;
+}
+
+/*
+ * Flush the DRM event queue when full; makes space for new events.
+ */
+static Bool
+amdgpu_present_flush_drm_events(ScreenPtr screen)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	drmmode_ptr drmmode = &info->drmmode;
+	struct pollfd p = { .fd = drmmode->fd, .events = POLLIN };
+	int r;
+
+	do {
+		r = poll(&p, 1, 0);
+	} while (r == -1 && (errno == EINTR || errno == EAGAIN));
+
+	if (r <= 0)
+		return FALSE;
+
+	return drmHandleEvent(drmmode->fd, &drmmode->event_context) >= 0;
+}
+
+/*
+ * Called when the queued vblank event or page flip has occurred
+ */
+static void
+amdgpu_present_event_handler(unsigned int frame, unsigned int tv_sec,
+			     unsigned int tv_usec, void *data)
+{
+	struct amdgpu_present_vblank_event *event = data;
+	uint64_t msc = frame;
+
+	if (event->crtc)
+		msc += amdgpu_get_interpolated_vblanks(event->crtc);
+
+	present_event_notify(event->event_id,
+			     (uint64_t)tv_sec * 1000000 + tv_usec,
+			     msc & 0xffffffff);
+	free(event);
+}
+
+/*
+ * Called when the queued vblank is aborted
+ */
+static void
+amdgpu_present_vblank_abort(void *data)
+{
+	struct amdgpu_present_vblank_event *event = data;
+
+	free(event);
+}
+
+/*
+ * Queue an event to report back to the Present extension when the specified
+ * MSC has passed
+ */
+static int
+amdgpu_present_queue_vblank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+	xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+	ScreenPtr screen = crtc->pScreen;
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	struct amdgpu_present_vblank_event *event;
+	uintptr_t drm_queue_seq;
+	drmVBlank vbl;
+	int ret;
+
+	/* There are no vblank events while the CRTC is off, the Present
+	 * extension executes the request right away when queueing fails
+	 */
+	if (!amdgpu_crtc_is_enabled(xf86_crtc))
+		return BadAlloc;
+
+	event = calloc(sizeof(struct amdgpu_present_vblank_event), 1);
+	if (!event)
+		return BadAlloc;
+	event->event_id = event_id;
+	event->crtc = xf86_crtc;
+
+	drm_queue_seq = amdgpu_drm_queue_alloc(scrn, event_id, event,
+					       amdgpu_present_event_handler,
+					       amdgpu_present_vblank_abort);
+	if (!drm_queue_seq) {
+		free(event);
+		return BadAlloc;
+	}
+
+	vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT;
+	vbl.request.type |= amdgpu_populate_vbl_request_type(xf86_crtc);
+	vbl.request.sequence = msc - amdgpu_get_interpolated_vblanks(xf86_crtc);
+	vbl.request.signal = drm_queue_seq;
+	for (;;) {
+		ret = drmWaitVBlank(info->dri2.drm_fd, &vbl);
+		if (!ret)
+			break;
+		/* If we hit EBUSY, then try to flush events. If we can't,
+		 * then this is an error
+		 */
+		if (errno != EBUSY || !amdgpu_present_flush_drm_events(screen)) {
+			amdgpu_drm_abort_entry(drm_queue_seq);
+			return BadAlloc;
+		}
+	}
+
+	return Success;
+}
+
+/*
+ * Remove a pending vblank event from the DRM queue so that it is not reported
+ * to the extension
+ */
+static void
+amdgpu_present_abort_vblank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+	amdgpu_drm_abort_id(event_id);
+}
+
+/*
+ * Flush our batch buffer when requested by the Present extension.
+ */
+static void
+amdgpu_present_flush(WindowPtr window)
+{
+	amdgpu_glamor_flush(xf86ScreenToScrn(window->drawable.pScreen));
+}
+
+/*
+ * Test to see if page flipping is possible on the target crtc
+ */
+static Bool
+amdgpu_present_check_flip(RRCrtcPtr crtc, WindowPtr window, PixmapPtr pixmap,
+			  Bool sync_flip)
+{
+	ScreenPtr screen = window->drawable.pScreen;
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+	PixmapPtr screen_pixmap = screen->GetScreenPixmap(screen);
+	struct amdgpu_buffer *bo;
+	int i;
+
+	if (!scrn->vtSema)
+		return FALSE;
+
+	if (!info->allowPageFlip)
+		return FALSE;
+
+	if (!sync_flip && !info->present_async_flip)
+		return FALSE;
+
+	if (!crtc || !amdgpu_crtc_is_enabled(crtc->devPrivate))
+		return FALSE;
+
+	/* The new front buffer replaces the screen pixmap on all CRTCs */
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr xf86_crtc = config->crtc[i];
+
+		if (!xf86_crtc->enabled)
+			continue;
+
+		if (!amdgpu_crtc_is_enabled(xf86_crtc) ||
+		    xf86_crtc->rotatedData)
+			return FALSE;
+
+#ifdef AMDGPU_PIXMAP_SHARING
+		if (xf86_crtc->randr_crtc &&
+		    xf86_crtc->randr_crtc->scanout_pixmap)
+			return FALSE;
+#endif
+	}
+
+	/* Page flips only change the base address, the layout has to match
+	 * the screen pixmap
+	 */
+	if (pixmap->drawable.width != screen_pixmap->drawable.width ||
+	    pixmap->drawable.height != screen_pixmap->drawable.height ||
+	    pixmap->drawable.bitsPerPixel !=
+	    screen_pixmap->drawable.bitsPerPixel ||
+	    pixmap->devKind != screen_pixmap->devKind)
+		return FALSE;
+
+	bo = amdgpu_get_pixmap_bo(pixmap);
+	if (!bo && info->use_glamor && amdgpu_glamor_export_pixmap(pixmap))
+		bo = amdgpu_get_pixmap_bo(pixmap);
+
+	/* The display engine can't scan out of user memory */
+	if (!bo || (bo->flags & AMDGPU_BO_FLAGS_USERPTR))
+		return FALSE;
+
+	/* Client BOs come from Mesa's allocator and may be tiled differently */
+	if (!amdgpu_bo_same_tiling(scrn, bo, info->front_buffer))
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Queue a flip on 'crtc' to 'pixmap' at 'target_msc'. If 'sync_flip' is true,
+ * then wait for vblank. Otherwise, flip immediately
+ */
+static Bool
+amdgpu_present_flip(RRCrtcPtr crtc, uint64_t event_id, uint64_t target_msc,
+		    PixmapPtr pixmap, Bool sync_flip)
+{
+	ScreenPtr screen = crtc->pScreen;
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+	struct amdgpu_present_vblank_event *event;
+	Bool ret;
+
+	if (!amdgpu_present_check_flip(crtc, screen->root, pixmap, sync_flip))
+		return FALSE;
+
+	event = calloc(1, sizeof(struct amdgpu_present_vblank_event));
+	if (!event)
+		return FALSE;
+
+	event->event_id = event_id;
+	event->crtc = xf86_crtc;
+
+	ret = amdgpu_do_pageflip(scrn, amdgpu_get_pixmap_bo(pixmap), event,
+				 drmmode_get_crtc_id(xf86_crtc),
+				 amdgpu_present_event_handler, !sync_flip);
+	if (!ret) {
+		xf86DrvMsg(scrn->scrnIndex, X_ERROR, "present flip failed\n");
+		free(event);
+	}
+
+	return ret;
+}
+
+/*
+ * Queue a flip back to the normal frame buffer
+ */
+static void
+amdgpu_present_unflip(ScreenPtr screen, uint64_t event_id)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
+	struct amdgpu_present_vblank_event *event;
+	PixmapPtr pixmap = screen->GetScreenPixmap(screen);
+	xf86CrtcPtr ref_crtc = NULL;
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		if (config->crtc[i]->enabled) {
+			ref_crtc = config->crtc[i];
+			break;
+		}
+	}
+
+	if (!ref_crtc ||
+	    !amdgpu_present_check_flip(ref_crtc->randr_crtc, screen->root,
+				       pixmap, TRUE))
+		goto modeset;
+
+	event = calloc(1, sizeof(struct amdgpu_present_vblank_event));
+	if (!event)
+		goto modeset;
+
+	event->event_id = event_id;
+	event->crtc = ref_crtc;
+
+	if (amdgpu_do_pageflip(scrn, info->front_buffer, event,
+			       drmmode_get_crtc_id(ref_crtc),
+			       amdgpu_present_event_handler, FALSE))
+		return;
+
+	free(event);
+
+modeset:
+	/* Scan out of the screen pixmap again with a modeset */
+	info->drmmode.fb_id = 0;
+	xf86SetDesiredModes(scrn);
+	present_event_notify(event_id, 0, 0);
+}
+
+static present_screen_info_rec amdgpu_present_screen_info = {
+	.version = 0,
+
+	.get_crtc = amdgpu_present_get_crtc,
+	.get_ust_msc = amdgpu_present_get_ust_msc,
+	.queue_vblank = amdgpu_present_queue_vblank,
+	.abort_vblank = amdgpu_present_abort_vblank,
+	.flush = amdgpu_present_flush,
+
+	.capabilities = PresentCapabilityNone,
+	.check_flip = amdgpu_present_check_flip,
+	.flip = amdgpu_present_flip,
+	.unflip = amdgpu_present_unflip,
+};
+
+Bool
+amdgpu_present_screen_init(ScreenPtr screen)
+{
+	ScrnInfoPtr scrn = xf86ScreenToScrn(screen);
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	uint64_t value;
+
+	info->present_async_flip = FALSE;
+#ifdef DRM_MODE_PAGE_FLIP_ASYNC
+	if (drmGetCap(info->dri2.drm_fd, DRM_CAP_ASYNC_PAGE_FLIP, &value) == 0 &&
+	    value == 1) {
+		info->present_async_flip = TRUE;
+		amdgpu_present_screen_info.capabilities |=
+			PresentCapabilityAsync;
+	}
+#endif
+
+	if (!present_screen_init(screen, &amdgpu_present_screen_info)) {
+		xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+			   "Present extension disabled because present_screen_init failed\n");
+		return FALSE;
+	}
+
+	xf86DrvMsg(scrn->scrnIndex, X_INFO, "Present extension enabled\n");
+
+	return TRUE;
+}
+
+#else /* !HAVE_PRESENT_H */
+
+Bool
+amdgpu_present_screen_init(ScreenPtr screen)
+{
+	xf86DrvMsg(xf86ScreenToScrn(screen)->scrnIndex, X_INFO,
+		   "Present extension disabled because present.h not available at "
+		   "build time\n");
+
+	return FALSE;
+}
+
+#endif
@@ -0,0 +1,354 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <xf86.h>
+#include "servermd.h"
+#include "amdgpu_drv.h"
+#include "amdgpu_readback.h"
+
+#ifdef HAVE_SSE41_STREAM_LOAD
+#include <smmintrin.h>
+#endif
+
+struct amdgpu_readback_entry {
+	struct xorg_list link;
+	BoxRec box;
+	/* Parts of box which hold the current front buffer contents */
+	RegionRec valid;
+	uint8_t *data;
+	int stride;
+};
+
+#ifdef HAVE_SSE41_STREAM_LOAD
+/* Streaming loads fetch whole lines from write-combined memory instead of
+ * doing an uncached read per load
+ */
+__attribute__((target("sse4.1")))
+static void amdgpu_readback_copy_sse41(uint8_t *dst, int dst_stride,
+				       const uint8_t *src, int src_stride,
+				       int width, int height)
+{
+	while (height--) {
+		const uint8_t *s = src;
+		uint8_t *d = dst;
+		int n = width;
+		int head = -(uintptr_t)s & 15;
+
+		if (head > n)
+			head = n;
+		memcpy(d, s, head);
+		s += head;
+		d += head;
+		n -= head;
+
+		for (; n >= 64; n -= 64, s += 64, d += 64) {
+			__m128i a = _mm_stream_load_si128((__m128i *)s);
+			__m128i b = _mm_stream_load_si128((__m128i *)(s + 16));
+			__m128i c = _mm_stream_load_si128((__m128i *)(s + 32));
+			__m128i e = _mm_stream_load_si128((__m128i *)(s + 48));
+
+			_mm_storeu_si128((__m128i *)d, a);
+			_mm_storeu_si128((__m128i *)(d + 16), b);
+			_mm_storeu_si128((__m128i *)(d + 32), c);
+			_mm_storeu_si128((__m128i *)(d + 48), e);
+		}
+
+		for (; n >= 16; n -= 16, s += 16, d += 16)
+			_mm_storeu_si128((__m128i *)d,
+					 _mm_stream_load_si128((__m128i *)s));
+
+		memcpy(d, s, n);
+
+		src += src_stride;
+		dst += dst_stride;
+	}
+}
+#endif
+
+/* Copy width bytes of each of height rows out of the front buffer */
+static void amdgpu_readback_copy(struct amdgpu_readback *readback,
+				 uint8_t *dst, int dst_stride,
+				 const uint8_t *src, int src_stride,
+				 int width, int height)
+{
+#ifdef HAVE_SSE41_STREAM_LOAD
+	if (readback->stream_load) {
+		amdgpu_readback_copy_sse41(dst, dst_stride, src, src_stride,
+					   width, height);
+		return;
+	}
+#endif
+
+	while (height--) {
+		memcpy(dst, src, width);
+		src += src_stride;
+		dst += dst_stride;
+	}
+}
+
+static void amdgpu_readback_entry_free(struct amdgpu_readback *readback,
+				       struct amdgpu_readback_entry *entry)
+{
+	xorg_list_del(&entry->link);
+	RegionUninit(&entry->valid);
+	free(entry->data);
+	free(entry);
+	readback->num_entries--;
+}
+
+static void amdgpu_readback_damage_report(DamagePtr damage, RegionPtr region,
+					  void *closure)
+{
+	ScrnInfoPtr pScrn = closure;
+	struct amdgpu_readback *readback = &AMDGPUPTR(pScrn)->readback;
+	struct amdgpu_readback_entry *entry;
+
+	xorg_list_for_each_entry(entry, &readback->entries, link)
+		RegionSubtract(&entry->valid, &entry->valid, region);
+}
+
+static Bool amdgpu_readback_damage_init(ScreenPtr pScreen,
+					struct amdgpu_readback *readback)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+
+	readback->damage = DamageCreate(amdgpu_readback_damage_report, NULL,
+					DamageReportRawRegion, TRUE, pScreen,
+					pScrn);
+	if (!readback->damage)
+		return FALSE;
+
+	DamageRegister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+		       readback->damage);
+	return TRUE;
+}
+
+static struct amdgpu_readback_entry *
+amdgpu_readback_entry_get(struct amdgpu_readback *readback, const BoxRec *box,
+			  int cpp)
+{
+	struct amdgpu_readback_entry *entry;
+
+	xorg_list_for_each_entry(entry, &readback->entries, link) {
+		if (box->x1 >= entry->box.x1 && box->x2 <= entry->box.x2 &&
+		    box->y1 >= entry->box.y1 && box->y2 <= entry->box.y2) {
+			xorg_list_del(&entry->link);
+			xorg_list_add(&entry->link, &readback->entries);
+			return entry;
+		}
+	}
+
+	if (readback->num_entries == AMDGPU_READBACK_ENTRIES)
+		amdgpu_readback_entry_free(readback,
+					   xorg_list_entry(readback->entries.prev,
+							   struct amdgpu_readback_entry,
+							   link));
+
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return NULL;
+
+	entry->box = *box;
+	entry->stride = (box->x2 - box->x1) * cpp;
+	entry->data = malloc(entry->stride * (box->y2 - box->y1));
+	if (!entry->data) {
+		free(entry);
+		return NULL;
+	}
+
+	RegionNull(&entry->valid);
+	xorg_list_add(&entry->link, &readback->entries);
+	readback->num_entries++;
+	return entry;
+}
+
+static Bool amdgpu_readback_get_image_staged(DrawablePtr pDrawable, int sx,
+					     int sy, int w, int h,
+					     unsigned int format,
+					     unsigned long planeMask, char *d)
+{
+	ScreenPtr pScreen = pDrawable->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct amdgpu_readback *readback = &AMDGPUPTR(pScrn)->readback;
+	PixmapPtr pixmap = pScreen->GetScreenPixmap(pScreen);
+	struct amdgpu_readback_entry *entry;
+	int bpp = pixmap->drawable.bitsPerPixel;
+	int cpp = bpp / 8;
+	int dst_stride, size;
+	RegionRec missing;
+	BoxRec box;
+	uint8_t *src;
+
+	if (format != ZPixmap || w <= 0 || h <= 0 || (bpp != 16 && bpp != 32) ||
+	    (planeMask & FbFullMask(pDrawable->depth)) !=
+	    FbFullMask(pDrawable->depth) || !pixmap->devPrivate.ptr)
+		return FALSE;
+
+	if (pDrawable->type == DRAWABLE_WINDOW) {
+		if (pScreen->GetWindowPixmap((WindowPtr)pDrawable) != pixmap)
+			return FALSE;
+	} else if ((PixmapPtr)pDrawable != pixmap)
+		return FALSE;
+
+	box.x1 = pDrawable->x + sx;
+	box.y1 = pDrawable->y + sy;
+	box.x2 = box.x1 + w;
+	box.y2 = box.y1 + h;
+	if (box.x1 < 0 || box.y1 < 0 || box.x2 > pixmap->drawable.width ||
+	    box.y2 > pixmap->drawable.height)
+		return FALSE;
+
+	src = pixmap->devPrivate.ptr;
+	dst_stride = PixmapBytePad(w, pDrawable->depth);
+	size = w * h * cpp;
+
+	if (size < AMDGPU_READBACK_MIN_SIZE || size > AMDGPU_READBACK_MAX_SIZE) {
+		amdgpu_readback_copy(readback, (uint8_t *)d, dst_stride,
+				     src + box.y1 * pixmap->devKind + box.x1 * cpp,
+				     pixmap->devKind, w * cpp, h);
+		return TRUE;
+	}
+
+	if (!readback->damage && !amdgpu_readback_damage_init(pScreen, readback))
+		return FALSE;
+
+	entry = amdgpu_readback_entry_get(readback, &box, cpp);
+	if (!entry)
+		return FALSE;
+
+	/* Only fetch what was damaged since the last read */
+	RegionInit(&missing, &box, 1);
+	RegionSubtract(&missing, &missing, &entry->valid);
+	if (RegionNotEmpty(&missing)) {
+		BoxPtr rects = RegionRects(&missing);
+		int i;
+
+		for (i = 0; i < RegionNumRects(&missing); i++) {
+			BoxPtr r = &rects[i];
+
+			amdgpu_readback_copy(readback,
+					     entry->data +
+					     (r->y1 - entry->box.y1) * entry->stride +
+					     (r->x1 - entry->box.x1) * cpp,
+					     entry->stride,
+					     src + r->y1 * pixmap->devKind +
+					     r->x1 * cpp,
+					     pixmap->devKind,
+					     (r->x2 - r->x1) * cpp, r->y2 - r->y1);
+		}
+
+		RegionUnion(&entry->valid, &entry->valid, &missing);
+		readback->misses++;
+	} else
+		readback->hits++;
+	RegionUninit(&missing);
+
+	src = entry->data + (box.y1 - entry->box.y1) * entry->stride +
+		(box.x1 - entry->box.x1) * cpp;
+	while (h--) {
+		memcpy(d, src, w * cpp);
+		src += entry->stride;
+		d += dst_stride;
+	}
+
+	return TRUE;
+}
+
+static void amdgpu_readback_get_image(DrawablePtr pDrawable, int sx, int sy,
+				      int w, int h, unsigned int format,
+				      unsigned long planeMask, char *d)
+{
+	ScreenPtr pScreen = pDrawable->pScreen;
+	struct amdgpu_readback *readback =
+		&AMDGPUPTR(xf86ScreenToScrn(pScreen))->readback;
+
+	if (amdgpu_readback_get_image_staged(pDrawable, sx, sy, w, h, format,
+					     planeMask, d))
+		return;
+
+	pScreen->GetImage = readback->GetImage;
+	(*pScreen->GetImage) (pDrawable, sx, sy, w, h, format, planeMask, d);
+	readback->GetImage = pScreen->GetImage;
+	pScreen->GetImage = amdgpu_readback_get_image;
+}
+
+void amdgpu_readback_init(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct amdgpu_readback *readback = &AMDGPUPTR(pScrn)->readback;
+
+	memset(readback, 0, sizeof(*readback));
+	xorg_list_init(&readback->entries);
+
+#ifdef HAVE_SSE41_STREAM_LOAD
+	readback->stream_load = __builtin_cpu_supports("sse4.1");
+#endif
+	xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
+		       "Front buffer reads %s streaming loads\n",
+		       readback->stream_load ? "use" : "don't use");
+
+	readback->GetImage = pScreen->GetImage;
+	pScreen->GetImage = amdgpu_readback_get_image;
+}
+
+void amdgpu_readback_invalidate(ScrnInfoPtr pScrn)
+{
+	struct amdgpu_readback *readback = &AMDGPUPTR(pScrn)->readback;
+	struct amdgpu_readback_entry *entry, *tmp;
+
+	if (!readback->GetImage)
+		return;
+
+	xorg_list_for_each_entry_safe(entry, tmp, &readback->entries, link)
+		amdgpu_readback_entry_free(readback, entry);
+}
+
+void amdgpu_readback_fini(ScrnInfoPtr pScrn)
+{
+	struct amdgpu_readback *readback = &AMDGPUPTR(pScrn)->readback;
+
+	if (!readback->GetImage)
+		return;
+
+	amdgpu_readback_invalidate(pScrn);
+
+	if (readback->damage) {
+#if XORG_VERSION_CURRENT < XORG_VERSION_NUMERIC(1,14,99,2,0)
+		ScreenPtr pScreen = xf86ScrnToScreen(pScrn);
+
+		DamageUnregister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+				 readback->damage);
+#else
+		DamageUnregister(readback->damage);
+#endif
+		DamageDestroy(readback->damage);
+		readback->damage = NULL;
+	}
+
+	xf86DrvMsgVerb(pScrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
+		       "Front buffer reads: %lu hits, %lu misses\n",
+		       readback->hits, readback->misses);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright © 2015 Advanced Micro Devices, Inc.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef AMDGPU_READBACK_H
+#define AMDGPU_READBACK_H 1
+
+#include <stdint.h>
+#include "list.h"
+#include "xf86str.h"
+#include "damage.h"
+
+/* Maximum number of front buffer regions kept in system memory */
+#define AMDGPU_READBACK_ENTRIES		4
+/* Reads outside of this range are served straight from the front buffer */
+#define AMDGPU_READBACK_MIN_SIZE	4096
+#define AMDGPU_READBACK_MAX_SIZE	(32 << 20)
+
+/* Copies of front buffer regions read by GetImage, so that repeated reads
+ * only fetch the parts which were damaged since from write-combined VRAM
+ */
+struct amdgpu_readback {
+	GetImageProcPtr GetImage;
+	DamagePtr damage;
+	/* Read VRAM with SSE4.1 streaming loads */
+	Bool stream_load;
+
+	struct xorg_list entries;	/* most recently used first */
+	unsigned num_entries;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+/* Wrap GetImage, only used without glamor or shadowfb */
+extern void amdgpu_readback_init(ScreenPtr pScreen);
+extern void amdgpu_readback_fini(ScrnInfoPtr pScrn);
+
+/* Drop all copies, when the front buffer is replaced */
+extern void amdgpu_readback_invalidate(ScrnInfoPtr pScrn);
+
+#endif /* AMDGPU_READBACK_H */
@@ -203,6 +203,65 @@ int drmmode_get_current_ust(int drm_fd, CARD64 * ust)
 	return 0;
 }
 
+/*
+ * Get current frame count and frame count timestamp of the crtc. While the
+ * crtc is in DPMS off state, they are extrapolated from the last vblank
+ * before it was turned off.
+ */
+Bool drmmode_crtc_get_ust_msc(xf86CrtcPtr crtc, CARD64 *ust, CARD64 *msc)
+{
+	ScrnInfoPtr scrn = crtc->scrn;
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmVBlank vbl;
+	int ret;
+
+	if (drmmode_crtc->dpms_mode == DPMSModeOn) {
+		/* CRTC is running, read vblank counter and timestamp */
+		vbl.request.type = DRM_VBLANK_RELATIVE;
+		vbl.request.type |= amdgpu_populate_vbl_request_type(crtc);
+		vbl.request.sequence = 0;
+
+		ret = drmWaitVBlank(info->dri2.drm_fd, &vbl);
+		if (ret) {
+			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
+				   "get vblank counter failed: %s\n",
+				   strerror(errno));
+			return FALSE;
+		}
+
+		*ust =
+		    ((CARD64) vbl.reply.tval_sec * 1000000) +
+		    vbl.reply.tval_usec;
+		*msc = vbl.reply.sequence + drmmode_crtc->interpolated_vblanks;
+		*msc &= 0xffffffff;
+	} else {
+		/* CRTC is not running, extrapolate MSC and timestamp */
+		CARD64 now, delta_t, delta_seq;
+
+		if (!drmmode_crtc->dpms_last_ust)
+			return FALSE;
+		ret = drmmode_get_current_ust(info->dri2.drm_fd, &now);
+		if (ret) {
+			xf86DrvMsg(scrn->scrnIndex, X_ERROR,
+				   "%s cannot get current time\n", __func__);
+			return FALSE;
+		}
+		delta_t = now - drmmode_crtc->dpms_last_ust;
+		delta_seq = delta_t * drmmode_crtc->dpms_last_fps;
+		delta_seq /= 1000000;
+		*ust = drmmode_crtc->dpms_last_ust;
+		delta_t = delta_seq * 1000000;
+		delta_t /= drmmode_crtc->dpms_last_fps;
+		*ust += delta_t;
+		*msc = drmmode_crtc->dpms_last_seq;
+		*msc += drmmode_crtc->interpolated_vblanks;
+		*msc += delta_seq;
+		*msc &= 0xffffffff;
+	}
+	return TRUE;
+}
+
 static void drmmode_crtc_dpms(xf86CrtcPtr crtc, int mode)
 {
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
@@ -285,6 +344,49 @@ void drmmode_copy_fb(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 	}
 }
 
+Bool drmmode_get_fb_id(ScrnInfoPtr scrn, struct amdgpu_buffer *bo,
+		       int width, int height, int pitch, uint32_t *fb_id)
+{
+	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
+	uint32_t handle;
+
+	/* The display engine can only scan out of VRAM */
+	if (amdgpu_bo_placement_migrated(bo) &&
+	    !amdgpu_bo_placement_migrate(scrn, bo, bo->cache_key.domain))
+		return FALSE;
+
+	if (bo->fb_id) {
+		if (bo->fb_width == width && bo->fb_height == height &&
+		    bo->fb_pitch == pitch && bo->fb_depth == scrn->depth &&
+		    bo->fb_bpp == scrn->bitsPerPixel) {
+			*fb_id = bo->fb_id;
+			return TRUE;
+		}
+
+		drmModeRmFB(info->drmmode.fd, bo->fb_id);
+		bo->fb_id = 0;
+	}
+
+	if (!amdgpu_bo_get_handle(bo, &handle))
+		return FALSE;
+
+	if (drmModeAddFB(info->drmmode.fd, width, height, scrn->depth,
+			 scrn->bitsPerPixel, pitch, handle, &bo->fb_id)) {
+		bo->fb_id = 0;
+		return FALSE;
+	}
+
+	bo->fb_width = width;
+	bo->fb_height = height;
+	bo->fb_pitch = pitch;
+	bo->fb_depth = scrn->depth;
+	bo->fb_bpp = scrn->bitsPerPixel;
+	bo->fb_fd = info->drmmode.fd;
+
+	*fb_id = bo->fb_id;
+	return TRUE;
+}
+
 static Bool
 drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
 		       Rotation rotation, int x, int y)
@@ -303,30 +405,23 @@ drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
 	int i;
 	int fb_id;
 	drmModeModeInfo kmode;
-	union gbm_bo_handle bo_handle;
 
 	if (drmmode->fb_id == 0) {
-		if (info->gbm) {
-			bo_handle = gbm_bo_get_handle(info->front_buffer->bo.gbm);
-		} else {
-			if (amdgpu_bo_export(info->front_buffer->bo.amdgpu,
-					     amdgpu_bo_handle_type_kms,
-					     &bo_handle.u32)) {
-				ErrorF("failed to get BO handle for FB\n");
-				return FALSE;
-			}
-		}
+		uint32_t front_fb_id;
 
-		ret = drmModeAddFB(drmmode->fd,
-				   pScrn->virtualX,
-				   pScrn->virtualY,
-				   pScrn->depth, pScrn->bitsPerPixel,
-				   pScrn->displayWidth * info->pixel_bytes,
-				   bo_handle.u32, &drmmode->fb_id);
-		if (ret < 0) {
+		if (!drmmode_get_fb_id(pScrn, info->front_buffer,
+				       pScrn->virtualX, pScrn->virtualY,
+				       pScrn->displayWidth * info->pixel_bytes,
+				       &front_fb_id)) {
 			ErrorF("failed to add fb\n");
 			return FALSE;
 		}
+		drmmode->fb_id = front_fb_id;
+
+		if (drmmode->scanout_bo) {
+			amdgpu_bo_unref(&drmmode->scanout_bo);
+			drmmode->scanout_bo = NULL;
+		}
 	}
 
 	saved_mode = crtc->mode;
@@ -478,20 +573,14 @@ static void drmmode_show_cursor(xf86CrtcPtr crtc)
 	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	union gbm_bo_handle bo_handle;
+	uint32_t bo_handle;
 
-	if (info->gbm) {
-		bo_handle = gbm_bo_get_handle(drmmode_crtc->cursor_buffer->bo.gbm);
-	} else {
-		if (amdgpu_bo_export(drmmode_crtc->cursor_buffer->bo.amdgpu,
-				     amdgpu_bo_handle_type_kms,
-				     &bo_handle.u32)) {
-			ErrorF("failed to get BO handle for cursor\n");
-			return;
-		}
+	if (!amdgpu_bo_get_handle(drmmode_crtc->cursor_buffer, &bo_handle)) {
+		ErrorF("failed to get BO handle for cursor\n");
+		return;
 	}
 
-	drmModeSetCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id, bo_handle.u32,
+	drmModeSetCursor(drmmode->fd, drmmode_crtc->mode_crtc->crtc_id, bo_handle,
 			 info->cursor_w, info->cursor_h);
 }
 
@@ -501,11 +590,9 @@ static void *drmmode_crtc_shadow_allocate(xf86CrtcPtr crtc, int width,
 	ScrnInfoPtr pScrn = crtc->scrn;
 	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
 	struct amdgpu_buffer *rotate_buffer = NULL;
-	int ret;
 	int pitch;
-	union gbm_bo_handle bo_handle;
+	uint32_t rotate_fb_id = 0;
 
 	/* rotation requires acceleration */
 	if (info->shadow_fb) {
@@ -515,7 +602,8 @@ static void *drmmode_crtc_shadow_allocate(xf86CrtcPtr crtc, int width,
 	}
 
 	rotate_buffer = amdgpu_alloc_pixmap_bo(pScrn, width, height,
-					       pScrn->depth, 0,
+					       pScrn->depth,
+					       AMDGPU_CREATE_PIXMAP_SCANOUT,
 					       pScrn->bitsPerPixel, &pitch);
 	if (!rotate_buffer) {
 		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
@@ -523,13 +611,11 @@ static void *drmmode_crtc_shadow_allocate(xf86CrtcPtr crtc, int width,
 		return NULL;
 	}
 
-	bo_handle = gbm_bo_get_handle(rotate_buffer->bo.gbm);
-	ret = drmModeAddFB(drmmode->fd, width, height, crtc->scrn->depth,
-			   crtc->scrn->bitsPerPixel, pitch,
-			   bo_handle.u32, &drmmode_crtc->rotate_fb_id);
-	if (ret) {
+	if (!drmmode_get_fb_id(pScrn, rotate_buffer, width, height, pitch,
+			       &rotate_fb_id)) {
 		ErrorF("failed to add rotate fb\n");
 	}
+	drmmode_crtc->rotate_fb_id = rotate_fb_id;
 
 	drmmode_crtc->rotate_buffer = rotate_buffer;
 	return rotate_buffer;
@@ -567,13 +653,11 @@ drmmode_crtc_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr rotate_pixmap,
 			    void *data)
 {
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
 
 	if (rotate_pixmap)
 		drmmode_destroy_bo_pixmap(rotate_pixmap);
 
 	if (data) {
-		drmModeRmFB(drmmode->fd, drmmode_crtc->rotate_fb_id);
 		drmmode_crtc->rotate_fb_id = 0;
 		amdgpu_bo_unref(&drmmode_crtc->rotate_buffer);
 		drmmode_crtc->rotate_buffer = NULL;
@@ -1271,18 +1355,20 @@ static Bool drmmode_xf86crtc_resize(ScrnInfoPtr scrn, int width, int height)
 	drmmode_ptr drmmode = drmmode_crtc->drmmode;
 	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
 	struct amdgpu_buffer *old_front = NULL;
-	Bool ret;
 	ScreenPtr screen = xf86ScrnToScreen(scrn);
-	uint32_t old_fb_id;
+	uint32_t old_fb_id, fb_id;
 	int i, pitch, old_width, old_height, old_pitch;
 	int cpp = info->pixel_bytes;
 	PixmapPtr ppix = screen->GetScreenPixmap(screen);
 	void *fb_shadow;
-	int hint = info->use_glamor ? 0 : AMDGPU_CREATE_PIXMAP_LINEAR;
+	int hint = AMDGPU_CREATE_PIXMAP_SCANOUT;
 
 	if (scrn->virtualX == width && scrn->virtualY == height)
 		return TRUE;
 
+	if (!info->use_glamor)
+		hint |= AMDGPU_CREATE_PIXMAP_LINEAR;
+
 	xf86DrvMsg(scrn->scrnIndex, X_INFO,
 		   "Allocate new frame buffer %dx%d\n", width, height);
 
@@ -1314,35 +1400,16 @@ static Bool drmmode_xf86crtc_resize(ScrnInfoPtr scrn, int width, int height)
 	xf86DrvMsg(scrn->scrnIndex, X_INFO, " => pitch %d bytes\n", pitch);
 	scrn->displayWidth = pitch / cpp;
 
-	if (info->front_buffer->flags & AMDGPU_BO_FLAGS_GBM) {
-		union gbm_bo_handle bo_handle;
-
-		bo_handle = gbm_bo_get_handle(info->front_buffer->bo.gbm);
-		ret = drmModeAddFB(drmmode->fd, width, height, scrn->depth,
-				   scrn->bitsPerPixel, pitch,
-				   bo_handle.u32, &drmmode->fb_id);
-		if (ret) {
-			goto fail;
-		}
+	if (!drmmode_get_fb_id(scrn, info->front_buffer, width, height, pitch,
+			       &fb_id))
+		goto fail;
+	drmmode->fb_id = fb_id;
 
+	if (info->front_buffer->flags & AMDGPU_BO_FLAGS_GBM) {
 		amdgpu_set_pixmap_bo(ppix, info->front_buffer);
 		screen->ModifyPixmapHeader(ppix,
 					   width, height, -1, -1, pitch, info->front_buffer->cpu_ptr);
 	} else {
-		uint32_t bo_handle;
-
-		if (amdgpu_bo_export(info->front_buffer->bo.amdgpu,
-				     amdgpu_bo_handle_type_kms,
-				     &bo_handle)) {
-			goto fail;
-		}
-		ret = drmModeAddFB(drmmode->fd, width, height, scrn->depth,
-				   scrn->bitsPerPixel, pitch,
-				   bo_handle, &drmmode->fb_id);
-		if (ret) {
-			goto fail;
-		}
-
 		fb_shadow = calloc(1, pitch * scrn->virtualY);
 		if (fb_shadow == NULL)
 			goto fail;
@@ -1355,6 +1422,7 @@ static Bool drmmode_xf86crtc_resize(ScrnInfoPtr scrn, int width, int height)
 #if XORG_VERSION_CURRENT < XORG_VERSION_NUMERIC(1,9,99,1,0)
 	scrn->pixmapPrivate.ptr = ppix->devPrivate.ptr;
 #endif
+	amdgpu_readback_invalidate(scrn);
 
 	for (i = 0; i < xf86_config->num_crtc; i++) {
 		xf86CrtcPtr crtc = xf86_config->crtc[i];
@@ -1369,8 +1437,12 @@ static Bool drmmode_xf86crtc_resize(ScrnInfoPtr scrn, int width, int height)
 	if (info->use_glamor)
 		amdgpu_glamor_create_screen_resources(scrn->pScreen);
 
-	if (old_fb_id)
-		drmModeRmFB(drmmode->fd, old_fb_id);
+	/* The CRTCs scan out of the new front buffer now */
+	if (drmmode->scanout_bo) {
+		amdgpu_bo_unref(&drmmode->scanout_bo);
+		drmmode->scanout_bo = NULL;
+	}
+
 	if (old_front) {
 		amdgpu_bo_unref(&old_front);
 	}
@@ -1394,20 +1466,12 @@ static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
 	drmmode_xf86crtc_resize
 };
 
-static void
-drmmode_vblank_handler(int fd, unsigned int frame, unsigned int tv_sec,
-		       unsigned int tv_usec, void *event_data)
-{
-	amdgpu_dri2_frame_event_handler(frame, tv_sec, tv_usec, event_data);
-}
-
 static void
 drmmode_flip_handler(int fd, unsigned int frame, unsigned int tv_sec,
 		     unsigned int tv_usec, void *event_data)
 {
 	drmmode_flipevtcarrier_ptr flipcarrier = event_data;
 	drmmode_flipdata_ptr flipdata = flipcarrier->flipdata;
-	drmmode_ptr drmmode = flipdata->drmmode;
 
 	/* Is this the event whose info shall be delivered to higher level? */
 	if (flipcarrier->dispatch_me) {
@@ -1423,16 +1487,18 @@ drmmode_flip_handler(int fd, unsigned int frame, unsigned int tv_sec,
 	if (flipdata->flip_count > 0)
 		return;
 
-	/* Release framebuffer */
-	drmModeRmFB(drmmode->fd, flipdata->old_fb_id);
+	flipdata->drmmode->flip_pending = FALSE;
 
-	if (flipdata->event_data == NULL)
-		return;
+	/* The old front buffer is no longer scanned out, its framebuffer
+	 * goes away with the BO
+	 */
+	if (flipdata->old_front)
+		amdgpu_bo_unref(&flipdata->old_front);
 
 	/* Deliver cached msc, ust from reference crtc to flip event handler */
-	amdgpu_dri2_flip_event_handler(flipdata->fe_frame, flipdata->fe_tv_sec,
-				       flipdata->fe_tv_usec,
-				       flipdata->event_data);
+	if (flipdata->handler)
+		flipdata->handler(flipdata->fe_frame, flipdata->fe_tv_sec,
+				  flipdata->fe_tv_usec, flipdata->event_data);
 
 	free(flipdata);
 }
@@ -1479,7 +1545,7 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode, int cpp)
 	xf86InitialConfiguration(pScrn, TRUE);
 
 	drmmode->event_context.version = DRM_EVENT_CONTEXT_VERSION;
-	drmmode->event_context.vblank_handler = drmmode_vblank_handler;
+	drmmode->event_context.vblank_handler = amdgpu_drm_queue_handler;
 	drmmode->event_context.page_flip_handler = drmmode_flip_handler;
 
 	return TRUE;
@@ -1491,6 +1557,7 @@ void drmmode_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 	AMDGPUInfoPtr info = AMDGPUPTR(pScrn);
 
 	info->drmmode_inited = TRUE;
+	amdgpu_drm_queue_init();
 	if (pAMDGPUEnt->fd_wakeup_registered != serverGeneration) {
 		AddGeneralSocket(drmmode->fd);
 		RegisterBlockAndWakeupHandlers((BlockHandlerProcPtr) NoopDDA,
@@ -1509,6 +1576,13 @@ void drmmode_fini(ScrnInfoPtr pScrn, drmmode_ptr drmmode)
 	if (!info->drmmode_inited)
 		return;
 
+	amdgpu_drm_queue_close(pScrn);
+
+	if (drmmode->scanout_bo) {
+		amdgpu_bo_unref(&drmmode->scanout_bo);
+		drmmode->scanout_bo = NULL;
+	}
+
 	if (pAMDGPUEnt->fd_wakeup_registered == serverGeneration &&
 	    !--pAMDGPUEnt->fd_wakeup_ref) {
 		RemoveGeneralSocket(drmmode->fd);
@@ -1748,7 +1822,8 @@ void drmmode_uevent_fini(ScrnInfoPtr scrn, drmmode_ptr drmmode)
 }
 
 Bool amdgpu_do_pageflip(ScrnInfoPtr scrn, struct amdgpu_buffer *new_front,
-			void *data, int ref_crtc_hw_id)
+			void *data, int ref_crtc_hw_id,
+			amdgpu_drm_handler_proc handler, Bool async)
 {
 	AMDGPUInfoPtr info = AMDGPUPTR(scrn);
 	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(scrn);
@@ -1759,33 +1834,41 @@ Bool amdgpu_do_pageflip(ScrnInfoPtr scrn, struct amdgpu_buffer *new_front,
 	int height, emitted = 0;
 	drmmode_flipdata_ptr flipdata;
 	drmmode_flipevtcarrier_ptr flipcarrier;
-	union gbm_bo_handle bo_handle;
-	uint32_t handle;
+	uint32_t flip_flags = DRM_MODE_PAGE_FLIP_EVENT;
+	uint32_t fb_id;
+
+#ifdef DRM_MODE_PAGE_FLIP_ASYNC
+	if (async)
+		flip_flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+#endif
+
+	/* DRI2 and Present may try to flip at the same time, the caller
+	 * falls back to a copy while the other flip is in flight
+	 */
+	if (drmmode->flip_pending) {
+		xf86DrvMsgVerb(scrn->scrnIndex, X_INFO, AMDGPU_LOGLEVEL_DEBUG,
+			       "flip queue: flip already pending\n");
+		return FALSE;
+	}
 
 	if (info->front_buffer->flags & AMDGPU_BO_FLAGS_GBM) {
 		pitch = gbm_bo_get_stride(info->front_buffer->bo.gbm);
 		height = gbm_bo_get_height(info->front_buffer->bo.gbm);
-		bo_handle = gbm_bo_get_handle(new_front->bo.gbm);
-		handle = bo_handle.u32;
 	} else {
 		pitch = scrn->displayWidth;
 		height = scrn->virtualY;
-		if (amdgpu_bo_export(new_front->bo.amdgpu,
-				amdgpu_bo_handle_type_kms,
-				&handle))
-			goto error_out;
 	}
 
 	/*
-	 * Create a new handle for the back buffer
+	 * Look up or create the framebuffer for the back buffer
 	 */
 	old_fb_id = drmmode->fb_id;
 
-	if (drmModeAddFB(drmmode->fd, scrn->virtualX, height,
-			 scrn->depth, scrn->bitsPerPixel, pitch,
-			 handle, &drmmode->fb_id)) {
+	if (!drmmode_get_fb_id(scrn, new_front, scrn->virtualX, height,
+			       pitch, &fb_id))
 		goto error_out;
-	}
+	drmmode->fb_id = fb_id;
+
 	flipdata = calloc(1, sizeof(drmmode_flipdata_rec));
 	if (!flipdata) {
 		xf86DrvMsg(scrn->scrnIndex, X_WARNING,
@@ -1803,6 +1886,7 @@ Bool amdgpu_do_pageflip(ScrnInfoPtr scrn, struct amdgpu_buffer *new_front,
 	 */
 
 	flipdata->event_data = data;
+	flipdata->handler = handler;
 	flipdata->drmmode = drmmode;
 
 	for (i = 0; i < config->num_crtc; i++) {
@@ -1816,9 +1900,7 @@ Bool amdgpu_do_pageflip(ScrnInfoPtr scrn, struct amdgpu_buffer *new_front,
 		if (!flipcarrier) {
 			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
 				   "flip queue: carrier alloc failed.\n");
-			if (emitted == 0)
-				free(flipdata);
-			goto error_undo;
+			goto error_flipdata;
 		}
 
 		/* Only the reference crtc will finally deliver its page flip
@@ -1830,22 +1912,42 @@ Bool amdgpu_do_pageflip(ScrnInfoPtr scrn, struct amdgpu_buffer *new_front,
 
 		if (drmModePageFlip
 		    (drmmode->fd, drmmode_crtc->mode_crtc->crtc_id,
-		     drmmode->fb_id, DRM_MODE_PAGE_FLIP_EVENT, flipcarrier)) {
+		     drmmode->fb_id, flip_flags, flipcarrier)) {
 			xf86DrvMsg(scrn->scrnIndex, X_WARNING,
 				   "flip queue failed: %s\n", strerror(errno));
 			free(flipcarrier);
-			if (emitted == 0)
-				free(flipdata);
-			goto error_undo;
+			goto error_flipdata;
 		}
 		emitted++;
 	}
 
-	flipdata->old_fb_id = old_fb_id;
+	/* Keep the BO scanned out so far and its framebuffer alive until the
+	 * flip has completed. That's the front buffer unless an earlier flip
+	 * switched to another BO, whose reference moves to flipdata
+	 */
+	if (drmmode->scanout_bo) {
+		flipdata->old_front = drmmode->scanout_bo;
+	} else {
+		flipdata->old_front = info->front_buffer;
+		flipdata->old_front->ref_count++;
+	}
+	drmmode->scanout_bo = new_front;
+	new_front->ref_count++;
+	drmmode->flip_pending = TRUE;
 	return TRUE;
 
+error_flipdata:
+	/* Flips which were queued already complete without calling the
+	 * handler, the caller still owns data
+	 */
+	flipdata->flip_count--;
+	flipdata->handler = NULL;
+	if (emitted == 0)
+		free(flipdata);
+	else
+		drmmode->flip_pending = TRUE;
+
 error_undo:
-	drmModeRmFB(drmmode->fd, drmmode->fb_id);
 	drmmode->fb_id = old_fb_id;
 
 error_out:
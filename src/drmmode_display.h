@@ -34,6 +34,7 @@
 
 #include "amdgpu_probe.h"
 #include "amdgpu.h"
+#include "amdgpu_drm_queue.h"
 
 #ifndef DRM_CAP_TIMESTAMP_MONOTONIC
 #define DRM_CAP_TIMESTAMP_MONOTONIC 0x6
@@ -42,6 +43,12 @@
 typedef struct {
 	int fd;
 	unsigned fb_id;
+	/* BO currently scanned out after a page flip, NULL while the CRTCs
+	 * scan out of the front buffer set up by the last modeset
+	 */
+	struct amdgpu_buffer *scanout_bo;
+	/* Only one page flip can be in flight, DRI2 and Present share it */
+	Bool flip_pending;
 	drmModeResPtr mode_res;
 	drmModeFBPtr mode_fb;
 	int cpp;
@@ -55,9 +62,10 @@ typedef struct {
 
 typedef struct {
 	drmmode_ptr drmmode;
-	unsigned old_fb_id;
+	struct amdgpu_buffer *old_front;
 	int flip_count;
 	void *event_data;
+	amdgpu_drm_handler_proc handler;
 	unsigned int fe_frame;
 	unsigned int fe_tv_sec;
 	unsigned int fe_tv_usec;
@@ -118,8 +126,13 @@ extern void drmmode_uevent_init(ScrnInfoPtr scrn, drmmode_ptr drmmode);
 extern void drmmode_uevent_fini(ScrnInfoPtr scrn, drmmode_ptr drmmode);
 
 extern int drmmode_get_pitch_align(ScrnInfoPtr scrn, int bpe);
+extern Bool drmmode_get_fb_id(ScrnInfoPtr scrn, struct amdgpu_buffer *bo,
+			      int width, int height, int pitch,
+			      uint32_t *fb_id);
 Bool amdgpu_do_pageflip(ScrnInfoPtr scrn, struct amdgpu_buffer *new_front,
-			void *data, int ref_crtc_hw_id);
+			void *data, int ref_crtc_hw_id,
+			amdgpu_drm_handler_proc handler, Bool async);
 int drmmode_get_current_ust(int drm_fd, CARD64 * ust);
+Bool drmmode_crtc_get_ust_msc(xf86CrtcPtr crtc, CARD64 *ust, CARD64 *msc);
 
 #endif